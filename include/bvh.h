@@ -0,0 +1,40 @@
+#pragma once
+
+#include "mesh.h"
+#include "vec3.h"
+#include <array>
+#include <functional>
+#include <vector>
+
+namespace proxima {
+    BoundingBox merge(const BoundingBox &a, const BoundingBox &b);
+    float surface_area(const BoundingBox &box);
+
+    class BVHNode {
+    public:
+        BoundingBox box;
+        int parent;
+        int left;
+        int right;
+        int item; // -1 for inner nodes
+    };
+
+    // Binary tree over the bounds of a set of items, one item per leaf
+    class BVH {
+    private:
+        std::vector<BVHNode> _nodes;
+        std::vector<int> _leaves;
+        int _build(const std::vector<BoundingBox> &boxes, std::vector<int> &items, int begin, int end, int parent);
+
+    public:
+        int size() const { return this->_leaves.size(); }
+        const std::vector<BVHNode> &nodes() const { return this->_nodes; }
+        void build(const std::vector<BoundingBox> &boxes);
+        void refit(int item, const BoundingBox &box);
+        // Visits the items whose boxes are not entirely behind one of the planes
+        void query_frustum(const std::array<Vec4, 6> &planes, std::function<void(int)> visit) const;
+        // Visits the items whose boxes the ray enters before max_distance, closest subtree first.
+        // The visitor returns the distance the ray still has to beat.
+        void query_ray(Vec3 origin, Vec3 direction, float max_distance, std::function<float(int, float)> visit) const;
+    };
+}
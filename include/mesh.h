@@ -3,32 +3,128 @@
 #include "vec3.h"
 #include "texture.h"
 #include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 
 namespace proxima {
+    class BufferVertex {
+    public:
+        Vec3 position;
+        Vec3 normal;
+        Vec3 uv;
+        BufferVertex(Vec3 position=Vec3(), Vec3 normal=Vec3(0, 0, 1), Vec3 uv=Vec3()) :
+            position(position), normal(normal), uv(uv) {}
+    };
+
+    class BoundingBox {
+    public:
+        Vec3 min;
+        Vec3 max;
+    };
+
+    class BoundingSphere {
+    public:
+        Vec3 center;
+        float radius;
+    };
+
+    // Render-ready form of a mesh: one entry per unique corner and three indices per face
+    class MeshBuffers {
+    public:
+        std::vector<BufferVertex> vertices;
+        std::vector<uint32_t> indices;
+        BoundingBox bounding_box;
+        BoundingSphere bounding_sphere;
+    };
+
+    // Buffers of a MeshData, built on first use and only once, however many threads ask for
+    // them at the same time. Copies start out unbuilt, as geometry is only copied to be changed.
+    class LazyMeshBuffers {
+    private:
+        std::shared_ptr<const MeshBuffers> _buffers;
+        std::unique_ptr<std::once_flag> _once;
+
+    public:
+        LazyMeshBuffers() : _once(std::make_unique<std::once_flag>()) {}
+        explicit LazyMeshBuffers(std::shared_ptr<const MeshBuffers> buffers) : _buffers(buffers), _once(std::make_unique<std::once_flag>()) {}
+        LazyMeshBuffers(const LazyMeshBuffers&) : LazyMeshBuffers() {}
+        LazyMeshBuffers(LazyMeshBuffers &&other) : LazyMeshBuffers(std::move(other._buffers)) {}
+        LazyMeshBuffers &operator=(LazyMeshBuffers other) {
+            this->_buffers = std::move(other._buffers);
+            this->_once = std::move(other._once);
+            return *this;
+        }
+        template <typename Build>
+        const MeshBuffers &get(Build build) {
+            std::call_once(*this->_once, [&] {
+                if (!this->_buffers) this->_buffers = build();
+            });
+            return *this->_buffers;
+        }
+    };
+
+    // Geometry behind a mesh, shared by all its copies and never changed once built
+    class MeshData {
+    public:
+        std::vector<Vec3> vertices;
+        std::vector<Vec3> vertex_normals;
+        std::vector<Vec3> uv_coordinates;
+        std::vector<std::array<int, 9>> face_indices;
+        bool has_normal;
+        bool has_uv;
+        float error; // How far simplification may have moved the surface, in mesh units
+        mutable LazyMeshBuffers buffers;
+        MeshData() : has_normal(false), has_uv(false), error(0) {}
+    };
+
+    // Cheap to copy handle to shared geometry. Files and generator calls with the same
+    // parameters share one copy for as long as any handle to it is alive.
     class Mesh {
     private:
-        std::vector<Vec3> _vertices;
-        std::vector<Vec3> _vertex_normals;
-        std::vector<Vec3> _uv_coordinates;
-        std::vector<std::array<int, 9>> _face_indices;
-        bool _has_normal;
-        bool _has_uv;
+        std::shared_ptr<const MeshData> _data;
 
     public:
-        bool has_normal() const { return this->_has_normal; }
-        bool has_uv() const { return this->_has_uv; }
-        const std::vector<Vec3> &vertices() const { return this->_vertices; }
-        const std::vector<Vec3> &vertex_normals() const { return this->_vertex_normals; }
-        const std::vector<Vec3> &uv_coordinates() const { return this->_uv_coordinates; }
-        const std::vector<std::array<int, 9>> &face_indices() const { return this->_face_indices; }
-        Mesh smooth();
-        Mesh() : _has_normal(false), _has_uv(false) {};
+        bool has_normal() const { return this->_data->has_normal; }
+        bool has_uv() const { return this->_data->has_uv; }
+        float error() const { return this->_data->error; }
+        const std::vector<Vec3> &vertices() const { return this->_data->vertices; }
+        const std::vector<Vec3> &vertex_normals() const { return this->_data->vertex_normals; }
+        const std::vector<Vec3> &uv_coordinates() const { return this->_data->uv_coordinates; }
+        const std::vector<std::array<int, 9>> &face_indices() const { return this->_data->face_indices; }
+        const MeshBuffers &buffers() const;
+        const BoundingBox &bounding_box() const { return this->buffers().bounding_box; }
+        const BoundingSphere &bounding_sphere() const { return this->buffers().bounding_sphere; }
+        // Area weighted vertex normals. Welding by position also smooths across the seams where
+        // a position is repeated for another uv.
+        Mesh smooth(bool weld_positions=false) const;
+        // Welds equal vertices, drops the faces that leaves without area, orders the faces for
+        // vertex locality and lays the vertices out in the order the faces first use them
+        Mesh optimize(int cache_size=16) const;
+        // Collapses edges by quadric error until at most target_faces are left, or no more can
+        // go without moving a border or seam or folding the surface over
+        Mesh simplify(int target_faces) const;
+        // Ever coarser versions of the mesh, each with about half the faces of the one before
+        std::vector<Mesh> lod_chain(int min_faces=32) const;
+        // Average vertices transformed per face with a FIFO cache of post-transform vertices
+        float cache_miss_ratio(int cache_size=16) const;
+        Mesh() : _data(std::make_shared<const MeshData>()) {}
+        Mesh(std::shared_ptr<const MeshData> data) : _data(data) {}
+        // Reuses the cooked copy in cache_directory when the file has not changed since,
+        // and writes one otherwise. Set cache_directory empty to always parse.
         Mesh(std::string filename);
+        static std::string cache_directory;
         static Mesh Plane(int resolution=20);
         static Mesh Terrain(Texture heightmap, int resolution=20);
+        // func is called from several threads at once, and again on every call, as plots are
+        // not cached
         static Mesh Plot(float (*func)(float x, float y), float range, int resolution=20);
+        // The same with func filling z for a whole row of n points at a time, so it can be
+        // vectorized and carry state such as the time
+        static Mesh Plot(std::function<void(const float *x, const float *y, float *z, int n)> func, float range, int resolution=20);
         static Mesh Cube();
         static Mesh Sphere(int resolution=20);
         static Mesh Torus(float thickness=0.5, int resolution=20);
@@ -7,10 +7,21 @@
 #include <vector>
 
 namespace proxima {
+    enum CullMode {
+        CULL_BACK,
+        CULL_FRONT,
+        CULL_NONE
+    };
+
+    // Box around the corners of a mesh's own box once scaled, rotated and moved into place
+    BoundingBox transform_box(const BoundingBox &local, Vec3 position, Vec3 euler_angles, Vec3 scale);
+
     class Object {
     protected:
         Mesh _mesh;
         bool _is_light;
+        bool _is_instanced;
+        bool _is_terrain;
 
     public:
         Vec3 position;
@@ -18,13 +29,45 @@ namespace proxima {
         Vec3 scale;
         Texture texture;
         int shininess;
+        CullMode cull_mode;
+        // Coarser versions of the mesh, finest first. Each frame the coarsest one whose error
+        // stays within lod_pixel_error pixels on screen is drawn, and the mesh if none does.
+        std::vector<Mesh> lods;
+        float lod_pixel_error;
+        void generate_lods(int min_faces=32) { this->lods = this->_mesh.lod_chain(min_faces); }
         const Mesh &mesh() const { return this->_mesh; }
         bool is_light() const { return this->_is_light; }
+        bool is_instanced() const { return this->_is_instanced; }
+        bool is_terrain() const { return this->_is_terrain; }
+        virtual BoundingBox bounding_box() const;
         Object(
             Mesh mesh=Mesh::Cube(),
             Texture texture=Texture::Color(Vec3(1, 1, 1)),
             int shininess=32
         );
+        virtual ~Object() {}
+    };
+
+    // Transform and look of one copy of an instanced mesh, with texture indexing into its textures
+    class Instance {
+    public:
+        Vec3 position;
+        Vec3 euler_angles;
+        Vec3 scale;
+        int texture;
+        int shininess;
+        Instance(Vec3 position=Vec3(), Vec3 euler_angles=Vec3(), Vec3 scale=Vec3(1, 1, 1), int texture=0, int shininess=32) :
+            position(position), euler_angles(euler_angles), scale(scale), texture(texture), shininess(shininess) {}
+    };
+
+    // One mesh drawn many times. Instances are placed in world space, so the transform,
+    // texture and shininess inherited from Object go unused.
+    class InstancedObject : public Object {
+    public:
+        std::vector<Texture> textures;
+        std::vector<Instance> instances;
+        BoundingBox bounding_box() const override;
+        InstancedObject(Mesh mesh=Mesh::Cube(), std::vector<Texture> textures={Texture::Color(Vec3(1, 1, 1))});
     };
 
     class Camera : public Object {
@@ -39,7 +82,9 @@ namespace proxima {
     public:
         Vec3 color;
         float intensity;
-        PointLight(float intensity=20, Vec3 color=Vec3(1, 1, 1));
+        // Distance at which the light fades out completely, or 0 for a light that reaches everywhere
+        float radius;
+        PointLight(float intensity=20, Vec3 color=Vec3(1, 1, 1), float radius=0);
     };
 }
 
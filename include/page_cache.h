@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace proxima {
+    const int PAGE_BITS = 7;
+    const int PAGE_SIZE = 1 << PAGE_BITS;
+
+    class PageLevel {
+    public:
+        int width;
+        int height;
+        int pages_x;
+        int pages_y;
+        int first_page;
+    };
+
+    // Splits an image and its mip levels into PAGE_SIZE square pages in a cache file, so a
+    // PageCache can later bring in only the parts that are looked at. Edge pages repeat the
+    // last row and column. False if the image can't be read or the file can't be written.
+    bool write_page_file(std::string image_filename, std::string page_filename, int channels=4);
+    // Whether the page file was cut from the image as it is now, with that many channels
+    bool page_file_current(std::string image_filename, std::string page_filename, int channels=4);
+
+    class PageCache;
+    // A cache on the page file of an image, writing the file first when it is missing or
+    // out of date. Null if that fails.
+    std::shared_ptr<PageCache> open_page_file(std::string image_filename, std::string page_filename, int channels=4, int num_slots=256);
+
+    // Fixed number of pages of a page file kept in memory. Sampling notes every page it
+    // wants and falls back to coarser levels for those that are not in yet, and stream()
+    // brings in the pages wanted since the last call, evicting the least recently used.
+    // The levels that fit in one page stay in for good, so there is always a fallback.
+    class PageCache {
+    private:
+        int _width;
+        int _height;
+        int _channels;
+        std::vector<PageLevel> _levels;
+        size_t _page_bytes;
+        size_t _data_offset;
+
+        // The file is mapped where the platform allows and read page by page otherwise
+        const uint8_t *_mapped;
+        size_t _mapped_size;
+        FILE *_file;
+
+        std::vector<uint8_t> _slots;
+        std::vector<int> _slot_pages;     // -1 for free slots
+        std::vector<int> _page_slots;     // -1 for pages not in memory
+        std::vector<bool> _pinned;
+        std::unique_ptr<std::atomic<int>[]> _wanted; // Last frame each page was sampled in
+        std::atomic<int> _frame;
+        void _load(int page, int slot);
+
+    public:
+        int pages_per_stream;
+        PageCache(std::string page_filename, int num_slots=256, int pages_per_stream=32);
+        ~PageCache();
+        PageCache(const PageCache&) = delete;
+        PageCache &operator=(const PageCache&) = delete;
+        int width() const { return this->_width; }
+        int height() const { return this->_height; }
+        int channels() const { return this->_channels; }
+        const std::vector<PageLevel> &levels() const { return this->_levels; }
+        // False when the file is missing, cut short or not a page file
+        bool loaded() const { return !this->_levels.empty(); }
+        int num_slots() const { return this->_slot_pages.size(); }
+        int num_resident() const;
+        // The texel at x, y of a level packed as 0xRRGGBBAA, or of the finest coarser level
+        // holding it when its page is not in
+        inline uint32_t texel(int level, int x, int y) const;
+        // Pages sampled since the last stream() that were not in
+        int num_missing() const;
+        // Only to be called while nothing samples, as between frames. Gives the number of
+        // pages brought in.
+        int stream();
+    };
+
+    uint32_t PageCache::texel(int level, int x, int y) const {
+        int frame = this->_frame.load(std::memory_order_relaxed);
+        while (true) {
+            const PageLevel &l = this->_levels[level];
+            int page = l.first_page + (y >> PAGE_BITS) * l.pages_x + (x >> PAGE_BITS);
+            // Skip the write when it would change nothing, so threads don't fight over the line
+            if (this->_wanted[page].load(std::memory_order_relaxed) != frame)
+                this->_wanted[page].store(frame, std::memory_order_relaxed);
+
+            int slot = this->_page_slots[page];
+            if (slot != -1) {
+                size_t index = ((y & (PAGE_SIZE - 1)) << PAGE_BITS) | (x & (PAGE_SIZE - 1));
+                const uint8_t *texel = &this->_slots[slot * this->_page_bytes + index * this->_channels];
+                if (this->_channels == 1)
+                    return (texel[0] << 24) | (texel[0] << 16) | (texel[0] << 8) | 0xff;
+                return (texel[0] << 24) | (texel[1] << 16) | (texel[2] << 8) | texel[3];
+            }
+            level++;
+            x = std::min(x >> 1, this->_levels[level].width - 1);
+            y = std::min(y >> 1, this->_levels[level].height - 1);
+        }
+    }
+}
@@ -1,10 +1,14 @@
 #pragma once
 
 #include "vec3.h"
+#include "bvh.h"
 #include "mesh.h"
 #include "scene.h"
 #include "window.h"
 #include "objects.h"
+#include "page_cache.h"
+#include "terrain.h"
 #include "texture.h"
 #include "renderer.h"
+#include "thread_pool.h"
 
@@ -4,7 +4,10 @@
 #include "vec3.h"
 #include "objects.h"
 #include "scene.h"
+#include "terrain.h"
+#include "thread_pool.h"
 #include <array>
+#include <cstdint>
 #include <vector>
 
 namespace proxima {
@@ -18,23 +21,40 @@ namespace proxima {
             position(position), normal(normal), uv(uv), view_pos(view_pos) {}
     };
 
+    // Indices into the renderer's per-frame vertex array
     class Face {
     public:
-        std::array<Vertex*, 3> vertices;
-        Face(std::array<Vertex*, 3> vertices) : vertices(vertices) {};
+        std::array<int, 3> indices;
+        Face(std::array<int, 3> indices) : indices(indices) {};
     };
 
-    class Fragment {
+    // Material IDs pack two flags above the shininess
+    const uint16_t MATERIAL_SKYBOX = 1 << 15;
+    const uint16_t MATERIAL_LIGHT = 1 << 14;
+    const uint16_t MATERIAL_SHININESS = MATERIAL_LIGHT - 1;
+
+    class Primitive {
     public:
-        Vec3 color;
-        Vec3 normal;
-        Vec3 view_pos;
-        float depth;
-        Vec3 vision;
-        float shininess;
-        bool is_light;
-        bool is_skybox;
-        Fragment(float depth=1, bool is_skybox=false) : depth(depth), is_skybox(is_skybox) {}
+        Face face;
+        const Texture *texture;
+        uint16_t material;
+        Primitive(Face face, const Texture *texture, uint16_t material) :
+            face(face), texture(texture), material(material) {}
+    };
+
+    // One plane per attribute, so each pass only touches the bytes it needs,
+    // plus the depth range of every 8x8 block for early rejection
+    class GBuffer {
+    public:
+        float *depth;
+        uint32_t *normal;
+        uint32_t *albedo;
+        uint16_t *material;
+        int num_blocks_x;
+        float *block_min_depth;
+        float *block_max_depth;
+        GBuffer(int width, int height);
+        ~GBuffer();
     };
 
     class Renderer {
@@ -45,20 +65,66 @@ namespace proxima {
         float _aspect;
         const Scene *_scene;
         std::vector<PointLight> _light_sources;
+        std::vector<int> _unbounded_lights;
+        std::vector<int> _light_first_slice;
+        std::vector<int> _cluster_offsets;
+        std::vector<int> _cluster_lights;
         int *_frame_buffer;
-        Fragment *_fragment_buffer;
+        GBuffer *_gbuffer;
+        float _ray_fov;
+        std::vector<float> _ray_x;
+        std::vector<float> _ray_y;
         Mat4 _view_rotation;
         Mat4 _view_matrix;
         Mat4 _projection_matrix;
-        void _init_fragment_buffer();
+        std::array<Vec4, 6> _frustum_planes;
+        std::array<Vec4, 6> _world_frustum_planes;
+        ThreadPool *_thread_pool;
+        int _num_tiles_x;
+        int _num_tiles_y;
+        std::vector<Vertex> _vertices;
+        std::vector<Primitive> _primitives;
+        std::vector<Face> _clipped_faces;
+        std::vector<int> _clip_codes;
+        std::vector<std::vector<int>> _tile_bins;
+        void _clear_depth(int x0, int y0, int x1, int y1);
+        void _update_block_depth(int x0, int y0, int x1, int y1);
         void _calc_matrices();
-        void _rasterize(Face face, const Texture &texture, bool is_skybox, bool is_light, float shininess);
-        Vec3 _shade(const Fragment &frag);
+        void _calc_frustum_planes();
+        void _calc_view_rays();
+        int _depth_slice(float depth) const;
+        void _build_clusters();
+        void _rasterize(const Primitive &prim, int x0, int y0, int x1, int y1);
+        void _shade(int x, int y, int count);
+        void _shade_pixels(int x0, int y0, int x1, int y1);
+        void _clip_face(Face face, int planes, std::vector<Face> &new_faces);
+        bool _in_view(const MeshBuffers &buffers, const Mat4 &modelview_matrix, Vec3 scale, bool &inside) const;
         void _render_object(const Object &obj, bool is_skybox);
+        void _render_instance(const Object &obj, const Instance &instance, const Texture &texture, bool is_skybox);
+        void _render_terrain(const TerrainObject &terrain);
+        void _render_buffers(
+            const MeshBuffers &buffers, const std::vector<uint32_t> &indices, const Mat4 &modelview_matrix, const Mat4 &modelview_rotation,
+            Vec3 scale, bool inside, const Texture &texture, uint16_t material, CullMode cull_mode
+        );
+        void _bin_primitives();
+        void _render_tile(int tile);
 
     public:
-        Renderer(int width, int height);
+        static const int TILE_SIZE = 64;
+        static const int BLOCK_SIZE = 8;
+        // Lights are binned into clusters of one tile by one of these exponential depth slices
+        static const int CLUSTER_SLICES = 16;
+        static const int SUBPIXEL_BITS = 8;
+        static const int SUBPIXEL = 1 << SUBPIXEL_BITS;
+        static const int NUM_CLIP_PLANES = 6;
+        static const int FRUSTUM_MASK = (1 << NUM_CLIP_PLANES) - 1;
+        static const int MAX_CLIP_VERTICES = 3 + NUM_CLIP_PLANES;
+        // Faces are only clipped at the sides once they stray this many half-screens from the center
+        static constexpr float GUARD_BAND = 8;
+        Renderer(int width, int height, int num_threads=std::thread::hardware_concurrency());
         ~Renderer();
+        int num_threads() const { return this->_thread_pool->num_threads(); }
+        void set_num_threads(int num_threads);
         int *render(const Scene &scene);
     };
 }
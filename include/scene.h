@@ -1,15 +1,38 @@
 #pragma once
 
+#include "bvh.h"
 #include "objects.h"
 #include "texture.h"
 #include "vec3.h"
+#include <array>
+#include <functional>
+#include <limits>
+#include <set>
 #include <string>
 #include <map>
+#include <vector>
 
 namespace proxima {
+    class RayHit {
+    public:
+        std::string name;
+        Object *object;
+        int instance; // -1 unless the object is instanced
+        float distance;
+        Vec3 position;
+        Vec3 normal;
+    };
+
     class Scene {
     private:
         std::map<std::string, Object*> _objects;
+        // Objects handed out since the hierarchy was last brought up to date
+        mutable std::set<std::string> _touched;
+        mutable BVH _bvh;
+        mutable std::vector<std::string> _bvh_names;
+        mutable std::vector<Object*> _bvh_objects;
+        mutable std::map<std::string, int> _bvh_items;
+        void _update_bvh() const;
 
     public:
         Camera camera;
@@ -19,6 +42,9 @@ namespace proxima {
         ~Scene();
         const std::map<std::string, Object*> &objects() const { return this->_objects; }
         Object *&operator[](std::string obj_name);
+        // Call after changing an object through a pointer kept outside the scene
+        void moved(std::string obj_name) { this->_touched.insert(obj_name); }
+        void query_frustum(const std::array<Vec4, 6> &planes, std::function<void(Object*)> visit) const;
+        bool raycast(Vec3 origin, Vec3 direction, RayHit &hit, float max_distance=std::numeric_limits<float>::max()) const;
     };
 }
-
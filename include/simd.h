@@ -0,0 +1,103 @@
+#pragma once
+
+#include "vec3.h"
+
+namespace proxima {
+    // Eight floats processed in lockstep, mapped onto SSE/AVX registers by GCC
+    typedef float Float8 __attribute__((vector_size(32)));
+    typedef int Int8 __attribute__((vector_size(32)));
+
+    const int LANES = 8;
+
+    inline Float8 splat(float a) {
+        return Float8{} + a;
+    }
+
+    inline Float8 min(Float8 a, Float8 b) {
+        return a < b ? a : b;
+    }
+
+    inline Float8 max(Float8 a, Float8 b) {
+        return a > b ? a : b;
+    }
+
+    inline Float8 select(Int8 mask, Float8 a, Float8 b) {
+        return mask ? a : b;
+    }
+
+    // 1/sqrt(x) from the bit-level guess plus two Newton steps, relative error below 5e-6
+    inline Float8 fast_rsqrt(Float8 x) {
+        Float8 y = (Float8)(0x5f3759df - ((Int8)x >> 1));
+        Float8 half_x = 0.5f * x;
+        y = y * (1.5f - half_x * y * y);
+        y = y * (1.5f - half_x * y * y);
+        return y;
+    }
+
+    // log2(x) for x > 0, absolute error below 1.2e-5
+    inline Float8 fast_log2(Float8 x) {
+        Int8 bits = (Int8)x;
+        Float8 exponent = __builtin_convertvector(((bits >> 23) & 0xff) - 127, Float8);
+        Float8 t = (Float8)((bits & 0x007fffff) | 0x3f800000) - 1.0f;
+        Float8 p = splat(-0.034595213f);
+        p = p * t + 0.14643362f;
+        p = p * t - 0.30338967f;
+        p = p * t + 0.46930169f;
+        p = p * t - 0.72044237f;
+        p = p * t + 1.44268325f;
+        return exponent + p * t;
+    }
+
+    // 2^x, relative error below 2e-7 for x in [-126, 127]
+    inline Float8 fast_exp2(Float8 x) {
+        x = max(min(x, splat(127)), splat(-126));
+        Int8 whole = __builtin_convertvector(x, Int8);
+        whole -= (Int8)(__builtin_convertvector(whole, Float8) > x) & 1;
+        Float8 f = x - __builtin_convertvector(whole, Float8);
+        Float8 p = splat(0.0018951098f);
+        p = p * f + 0.0089462083f;
+        p = p * f + 0.055863288f;
+        p = p * f + 0.24014077f;
+        p = p * f + 0.69315462f;
+        p = p * f + 0.99999990f;
+        return (Float8)((Int8)p + (whole << 23));
+    }
+
+    // x^y for x >= 0. The relative error grows with the exponent and stays below 6.5e-6 * y,
+    // so specular highlights are off by less than half an 8-bit step up to y = 256.
+    inline Float8 fast_pow(Float8 x, Float8 y) {
+        return select(x > 0.0f, fast_exp2(y * fast_log2(x)), splat(0));
+    }
+
+    class Vec3x8 {
+    public:
+        Float8 x, y, z;
+        Vec3x8() : x(), y(), z() {}
+        Vec3x8(Float8 x, Float8 y, Float8 z) : x(x), y(y), z(z) {}
+        Vec3x8(Vec3 v) : x(splat(v.x)), y(splat(v.y)), z(splat(v.z)) {}
+    };
+
+    inline Vec3x8 operator+(const Vec3x8 &a, const Vec3x8 &b) {
+        return Vec3x8(a.x + b.x, a.y + b.y, a.z + b.z);
+    }
+
+    inline Vec3x8 operator-(const Vec3x8 &a, const Vec3x8 &b) {
+        return Vec3x8(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    inline Vec3x8 operator*(const Vec3x8 &a, const Vec3x8 &b) {
+        return Vec3x8(a.x * b.x, a.y * b.y, a.z * b.z);
+    }
+
+    inline Vec3x8 operator*(Float8 a, const Vec3x8 &v) {
+        return Vec3x8(a * v.x, a * v.y, a * v.z);
+    }
+
+    inline Float8 dot(const Vec3x8 &a, const Vec3x8 &b) {
+        return a.x*b.x + a.y*b.y + a.z*b.z;
+    }
+
+    inline Vec3x8 select(Int8 mask, const Vec3x8 &a, const Vec3x8 &b) {
+        return Vec3x8(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "mesh.h"
+#include "objects.h"
+#include "page_cache.h"
+#include "texture.h"
+#include "vec3.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace proxima {
+    // One node of a terrain's quadtree, a grid of resolution by resolution quads sampling the
+    // heightmap level where its quads are one texel across. Besides the grid rows it holds the
+    // edges and corners once more for every level up, as a neighbour that many levels coarser
+    // samples them, so that both sides of a seam share their vertices.
+    class TerrainChunk {
+    public:
+        int level;
+        int x;
+        int y;
+        float error; // Largest height difference from the next finer level, 0 for the finest
+        MeshBuffers buffers;
+    };
+
+    // A chunk to draw and the indices stitching it to the chunks drawn around it
+    class TerrainPatch {
+    public:
+        std::shared_ptr<const TerrainChunk> chunk;
+        const std::vector<uint32_t> *indices;
+    };
+
+    // Heightmap far too large to draw as one mesh, split into a quadtree of chunks. Each frame
+    // the chunks whose error stays within lod_pixel_error pixels on screen are drawn, among
+    // those built so far. A worker thread builds the missing ones, coarsest first, reading
+    // only the pages of the heightmap they need from a page file written next to it.
+    class TerrainObject : public Object {
+    private:
+        std::shared_ptr<PageCache> _heights; // Only read by the worker, null when the heightmap can't be paged
+        int _map_width;
+        int _map_height;
+        int _extent;     // Texels across the root, the power of two covering the map
+        int _resolution;
+        int _max_level;  // Level of the chunks sampling every texel
+        int _max_diff;   // Most levels a neighbour can be coarser and still share vertices
+        float _size;
+        float _height;
+
+        mutable std::mutex _mutex;
+        mutable std::condition_variable _wake;
+        // Chunks built so far and the frame each was last drawn or looked at
+        mutable std::unordered_map<uint64_t, std::pair<std::shared_ptr<const TerrainChunk>, int>> _chunks;
+        mutable std::vector<uint64_t> _requests;
+        mutable uint64_t _building;
+        mutable int _frame;
+        mutable std::unordered_map<uint32_t, std::vector<uint32_t>> _stitches;
+        bool _stopping;
+        std::thread _worker;
+
+        float _sample(int mip, int gx, int gy) const;
+        BufferVertex _vertex(int mip, int gx, int gy) const;
+        std::shared_ptr<const TerrainChunk> _build(uint64_t node) const;
+        void _work();
+
+    public:
+        int max_chunks;
+        // Heights span 0 to height and the map spans size across, both in the terrain's own
+        // units. The resolution is rounded down to a power of two from 2 to 128.
+        TerrainObject(std::string heightmap, float size=1000, float height=100, int resolution=32, Texture texture=Texture::Color(Vec3(1, 1, 1)));
+        ~TerrainObject();
+        TerrainObject(const TerrainObject&) = delete;
+        TerrainObject &operator=(const TerrainObject&) = delete;
+        int num_levels() const { return this->_max_level + 1; }
+        int num_chunks() const;
+        int num_requests() const;
+        BoundingBox bounding_box() const override;
+        // Fills patches with the chunks to draw for an eye in the terrain's own space, given
+        // the pixels a unit covers at distance 1 and which chunks can be seen, and queues the
+        // chunks that would be drawn if they were there. Only to be called from one thread.
+        void select(Vec3 eye, float pixels_per_unit, std::function<bool(const MeshBuffers&)> visible, std::vector<TerrainPatch> &patches) const;
+    };
+}
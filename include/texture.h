@@ -1,32 +1,215 @@
 #pragma once
 
+#include "page_cache.h"
 #include "vec3.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <vector>
 #include <string>
 
 namespace proxima {
+    enum SampleMode {
+        SAMPLE_NEAREST,   // Nearest texel of the full size level, whatever the level of detail
+        SAMPLE_POINT,     // Nearest texel on the nearest mip level
+        SAMPLE_BILINEAR,  // Blend of four texels on the nearest mip level
+        SAMPLE_TRILINEAR  // Blend of the bilinear samples on the two nearest mip levels
+    };
+
+    enum TextureLayout {
+        LAYOUT_LINEAR,   // Row after row
+        LAYOUT_TILED_4,  // 4x4 blocks of texels row after row, each block itself row major
+        LAYOUT_TILED_8,  // The same with 8x8 blocks
+        LAYOUT_MORTON,   // Z-order, interleaving the bits of x and y
+        LAYOUT_BC1,      // 4x4 blocks compressed to two RGB565 endpoints and 2-bit indices, opaque
+        LAYOUT_VIRTUAL   // Pages of a page file brought in as they are sampled, see PageCache
+    };
+
+    class TextureLevel {
+    public:
+        int width;
+        int height;
+        size_t offset;
+        int tiles_x;     // Blocks or pages per row of the tiled, compressed and virtual layouts
+        int morton_bits; // Bits of x and y interleaved by the Morton layout
+    };
+
+    // Spreads the low 16 bits of a out to the even bits
+    inline uint32_t spread_bits(uint32_t a) {
+        a &= 0xffff;
+        a = (a | (a << 8)) & 0x00ff00ff;
+        a = (a | (a << 4)) & 0x0f0f0f0f;
+        a = (a | (a << 2)) & 0x33333333;
+        a = (a | (a << 1)) & 0x55555555;
+        return a;
+    }
+
+    // Texels behind a texture, shared by all its copies and never changed once built.
+    // Each texel is either RGBA or a single gray level, one byte per channel, and the
+    // mip levels follow the base one in the same array. Virtual textures keep no texels
+    // of their own and read them from their page cache instead. Levels in a blocked layout are padded
+    // out to whole blocks, so that texels close in both directions share cache lines.
+    class TextureData {
+    public:
+        int width;
+        int height;
+        int channels;
+        std::vector<uint8_t> texels;
+        std::vector<TextureLevel> levels;
+        TextureLayout layout;
+        int id; // Tells textures apart in the decoded block caches
+        std::shared_ptr<PageCache> pages;
+        // Expects the base level laid out row after row
+        void build_levels(TextureLayout layout=LAYOUT_LINEAR);
+        // Where the texel at x, y of a level starts in texels, for the uncompressed layouts
+        inline size_t texel_offset(const TextureLevel &level, int x, int y) const;
+        // The texel at x, y of a compressed level packed as 0xRRGGBBAA
+        uint32_t compressed_texel(const TextureLevel &level, int x, int y) const;
+    };
+
+    // Cheap to copy handle to shared texels. Files and checkerboards of the same size share
+    // one copy for as long as any handle to it is alive.
     class Texture {
     private:
-        int _width;
-        int _height;
-        std::vector<Vec3> _data;
+        std::shared_ptr<const TextureData> _data;
+        inline size_t _texel_index(Vec3 uv) const;
+        inline uint32_t _texel(const TextureLevel &level, int x, int y) const;
+        inline uint32_t _bilinear(const TextureLevel &level, Vec3 uv) const;
 
     public:
+        SampleMode sample_mode; // SAMPLE_NEAREST unless set, or trilinear for virtual textures
         Texture(int width=1, int height=1);
-        Texture(std::string filename);
+        // Pass 1 channel to keep only the gray level, as heightmaps need. Any other count loads
+        // all 4, the only other layout the samplers and the BC1 encoder read.
+        Texture(std::string filename, int channels=4, TextureLayout layout=LAYOUT_LINEAR);
+        // The data needs its levels built
+        Texture(std::shared_ptr<const TextureData> data) : _data(data), sample_mode(SAMPLE_NEAREST) {}
+        int width() const { return this->_data->width; }
+        int height() const { return this->_data->height; }
+        int channels() const { return this->_data->channels; }
+        int num_levels() const { return this->_data->levels.size(); }
+        TextureLayout layout() const { return this->_data->layout; }
         inline Vec3 at_uv(Vec3 uv) const;
+        // The base level texel packed as 0xRRGGBBAA
+        inline uint32_t rgba_at_uv(Vec3 uv) const;
+        // Filtered with the sample mode at a level of detail, where each level up halves the size
+        inline uint32_t sample(Vec3 uv, float lod) const;
         static Texture Color(Vec3 color);
         static Texture Checker(int width, int height);
+        // Samples a page file written next to the image on first use, keeping only
+        // num_slots pages of it in memory. Filtered trilinearly, as sampling only the full
+        // size level would bring in every page of it.
+        static Texture Virtual(std::string filename, int num_slots=256);
+        // Brings in the pages sampled since the last call. A no-op unless virtual.
+        void stream() const;
     };
 
-    Vec3 Texture::at_uv(Vec3 uv) const {
+    // Per-channel blend of two packed colors with t out of 256, two channels at a time
+    inline uint32_t lerp_rgba(uint32_t a, uint32_t b, int t) {
+        uint32_t rb = (((a & 0xff00ff) * (256 - t) + (b & 0xff00ff) * t) >> 8) & 0xff00ff;
+        uint32_t ga = (((a >> 8) & 0xff00ff) * (256 - t) + ((b >> 8) & 0xff00ff) * t) & 0xff00ff00;
+        return rb | ga;
+    }
+
+    size_t TextureData::texel_offset(const TextureLevel &level, int x, int y) const {
+        size_t index;
+        switch (this->layout) {
+            case LAYOUT_TILED_4:
+                index = ((size_t)((y >> 2) * level.tiles_x + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3);
+                break;
+            case LAYOUT_TILED_8:
+                index = ((size_t)((y >> 3) * level.tiles_x + (x >> 3)) << 6) | ((y & 7) << 3) | (x & 7);
+                break;
+            case LAYOUT_MORTON: {
+                // Past the interleaved bits only the longer side has any left, and they go on top
+                int bits = level.morton_bits;
+                uint32_t mask = (1 << bits) - 1;
+                index = ((size_t)((x | y) >> bits) << (2 * bits)) | spread_bits(x & mask) | (spread_bits(y & mask) << 1);
+                break;
+            }
+            default:
+                index = x + (size_t)y * level.width;
+        }
+        return level.offset + index * this->channels;
+    }
+
+    size_t Texture::_texel_index(Vec3 uv) const {
+        const TextureData &data = *this->_data;
         float u = uv.x;
         float v = 1 - uv.y;
-        int x = fmin(u * this->_width, this->_width - 1);
-        int y = fmin(v * this->_height, this->_height - 1);
-        int index = x + y * this->_width;
-        return this->_data[index];
+        int x = fmin(u * data.width, data.width - 1);
+        int y = fmin(v * data.height, data.height - 1);
+        return data.texel_offset(data.levels[0], x, y);
+    }
+
+    Vec3 Texture::at_uv(Vec3 uv) const {
+        if (this->_data->layout == LAYOUT_BC1 || this->_data->layout == LAYOUT_VIRTUAL) {
+            uint32_t rgba = this->rgba_at_uv(uv);
+            // Green keeps the most bits of a gray level
+            if (this->_data->channels == 1)
+                return Vec3((rgba >> 16) & 0xff, (rgba >> 16) & 0xff, (rgba >> 16) & 0xff) / 255;
+            return Vec3(rgba >> 24, (rgba >> 16) & 0xff, (rgba >> 8) & 0xff) / 255;
+        }
+        const uint8_t *texel = &this->_data->texels[this->_texel_index(uv)];
+        if (this->_data->channels == 1)
+            return Vec3(texel[0], texel[0], texel[0]) / 255;
+        return Vec3(texel[0], texel[1], texel[2]) / 255;
+    }
+
+    uint32_t Texture::rgba_at_uv(Vec3 uv) const {
+        const TextureData &data = *this->_data;
+        int x = fmin(uv.x * data.width, data.width - 1);
+        int y = fmin((1 - uv.y) * data.height, data.height - 1);
+        return this->_texel(data.levels[0], x, y);
     }
-}
 
+    uint32_t Texture::_texel(const TextureLevel &level, int x, int y) const {
+        const TextureData &data = *this->_data;
+        if (data.layout == LAYOUT_BC1)
+            return data.compressed_texel(level, x, y);
+        if (data.layout == LAYOUT_VIRTUAL)
+            return data.pages->texel(&level - &data.levels[0], x, y);
+        const uint8_t *texel = &data.texels[data.texel_offset(level, x, y)];
+        if (data.channels == 1)
+            return (texel[0] << 24) | (texel[0] << 16) | (texel[0] << 8) | 0xff;
+        return (texel[0] << 24) | (texel[1] << 16) | (texel[2] << 8) | texel[3];
+    }
+
+    uint32_t Texture::_bilinear(const TextureLevel &level, Vec3 uv) const {
+        float fx = uv.x * level.width - 0.5f;
+        float fy = (1 - uv.y) * level.height - 0.5f;
+        int x = floor(fx);
+        int y = floor(fy);
+        int tx = (fx - x) * 256;
+        int ty = (fy - y) * 256;
+
+        // Clamp the four corners to the edges once, rather than every texel
+        int x0 = std::clamp(x, 0, level.width - 1);
+        int x1 = std::clamp(x + 1, 0, level.width - 1);
+        int y0 = std::clamp(y, 0, level.height - 1);
+        int y1 = std::clamp(y + 1, 0, level.height - 1);
+        uint32_t top = lerp_rgba(this->_texel(level, x0, y0), this->_texel(level, x1, y0), tx);
+        uint32_t bottom = lerp_rgba(this->_texel(level, x0, y1), this->_texel(level, x1, y1), tx);
+        return lerp_rgba(top, bottom, ty);
+    }
+
+    uint32_t Texture::sample(Vec3 uv, float lod) const {
+        const std::vector<TextureLevel> &levels = this->_data->levels;
+        if (this->sample_mode == SAMPLE_NEAREST) return this->rgba_at_uv(uv);
+        lod = std::clamp(lod, 0.0f, (float)(levels.size() - 1));
+        if (this->sample_mode == SAMPLE_POINT) {
+            const TextureLevel &level = levels[(int)(lod + 0.5f)];
+            int x = std::clamp((int)(uv.x * level.width), 0, level.width - 1);
+            int y = std::clamp((int)((1 - uv.y) * level.height), 0, level.height - 1);
+            return this->_texel(level, x, y);
+        }
+        if (this->sample_mode == SAMPLE_BILINEAR)
+            return this->_bilinear(levels[(int)(lod + 0.5f)], uv);
+
+        int l = lod;
+        int t = (lod - l) * 256;
+        if (t == 0) return this->_bilinear(levels[l], uv);
+        return lerp_rgba(this->_bilinear(levels[l], uv), this->_bilinear(levels[l + 1], uv), t);
+    }
+}
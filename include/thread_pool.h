@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace proxima {
+    class ThreadPool {
+    private:
+        std::vector<std::thread> _workers;
+        std::mutex _mutex;
+        std::condition_variable _start;
+        std::condition_variable _done;
+        std::function<void(int)> _task;
+        std::atomic<int> _next_task;
+        int _num_tasks;
+        int _num_busy;
+        int _generation;
+        bool _stopping;
+        void _work();
+        void _drain();
+
+    public:
+        ThreadPool(int num_threads=std::thread::hardware_concurrency());
+        ~ThreadPool();
+        int num_threads() const { return this->_workers.size() + 1; }
+        void run(int num_tasks, std::function<void(int)> task);
+    };
+}
@@ -0,0 +1,180 @@
+#include "bvh.h"
+#include "mesh.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace proxima {
+    BoundingBox merge(const BoundingBox &a, const BoundingBox &b) {
+        BoundingBox box;
+        box.min = Vec3(fmin(a.min.x, b.min.x), fmin(a.min.y, b.min.y), fmin(a.min.z, b.min.z));
+        box.max = Vec3(fmax(a.max.x, b.max.x), fmax(a.max.y, b.max.y), fmax(a.max.z, b.max.z));
+        return box;
+    }
+
+    float surface_area(const BoundingBox &box) {
+        Vec3 size = box.max - box.min;
+        return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    float component(const Vec3 &v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    void BVH::build(const std::vector<BoundingBox> &boxes) {
+        this->_nodes.clear();
+        this->_leaves.assign(boxes.size(), -1);
+        if (boxes.empty()) return;
+
+        std::vector<int> items(boxes.size());
+        for (int i=0; i<(int)items.size(); i++) {
+            items[i] = i;
+        }
+        this->_nodes.reserve(2 * boxes.size() - 1);
+        this->_build(boxes, items, 0, items.size(), -1);
+    }
+
+    int BVH::_build(const std::vector<BoundingBox> &boxes, std::vector<int> &items, int begin, int end, int parent) {
+        int node = this->_nodes.size();
+        this->_nodes.push_back(BVHNode());
+        this->_nodes[node].parent = parent;
+        if (end - begin == 1) {
+            this->_nodes[node].box = boxes[items[begin]];
+            this->_nodes[node].left = -1;
+            this->_nodes[node].right = -1;
+            this->_nodes[node].item = items[begin];
+            this->_leaves[items[begin]] = node;
+            return node;
+        }
+
+        // Sweep each axis in centroid order for the split with the lowest surface area heuristic
+        int count = end - begin;
+        std::vector<float> left_area(count);
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = 0;
+        int best_split = 1;
+        for (int axis=0; axis<3; axis++) {
+            std::sort(items.begin() + begin, items.begin() + end, [&](int a, int b) {
+                return component(boxes[a].min + boxes[a].max, axis) < component(boxes[b].min + boxes[b].max, axis);
+            });
+            BoundingBox box = boxes[items[begin]];
+            for (int i=1; i<count; i++) {
+                left_area[i] = surface_area(box) * i;
+                box = merge(box, boxes[items[begin + i]]);
+            }
+            box = boxes[items[end - 1]];
+            for (int i=count-1; i>0; i--) {
+                float cost = left_area[i] + surface_area(box) * (count - i);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i;
+                }
+                box = merge(box, boxes[items[begin + i - 1]]);
+            }
+        }
+        std::sort(items.begin() + begin, items.begin() + end, [&](int a, int b) {
+            return component(boxes[a].min + boxes[a].max, best_axis) < component(boxes[b].min + boxes[b].max, best_axis);
+        });
+
+        int left = this->_build(boxes, items, begin, begin + best_split, node);
+        int right = this->_build(boxes, items, begin + best_split, end, node);
+        this->_nodes[node].box = merge(this->_nodes[left].box, this->_nodes[right].box);
+        this->_nodes[node].left = left;
+        this->_nodes[node].right = right;
+        this->_nodes[node].item = -1;
+        return node;
+    }
+
+    void BVH::refit(int item, const BoundingBox &box) {
+        // Only the path up to the root covers the item, so the rest of the tree stays put
+        int node = this->_leaves[item];
+        this->_nodes[node].box = box;
+        for (node = this->_nodes[node].parent; node != -1; node = this->_nodes[node].parent) {
+            BVHNode &parent = this->_nodes[node];
+            parent.box = merge(this->_nodes[parent.left].box, this->_nodes[parent.right].box);
+        }
+    }
+
+    void BVH::query_frustum(const std::array<Vec4, 6> &planes, std::function<void(int)> visit) const {
+        if (this->_nodes.empty()) return;
+
+        // Planes a node is entirely in front of are dropped for its whole subtree
+        std::vector<std::pair<int, int>> stack = {{0, (1 << planes.size()) - 1}};
+        while (!stack.empty()) {
+            auto [node, mask] = stack.back();
+            stack.pop_back();
+            const BVHNode &n = this->_nodes[node];
+            bool outside = false;
+            for (int i=0; i<(int)planes.size(); i++) {
+                if (!(mask & (1 << i))) continue;
+                const Vec4 &p = planes[i];
+                Vec3 far(p.x > 0 ? n.box.max.x : n.box.min.x, p.y > 0 ? n.box.max.y : n.box.min.y, p.z > 0 ? n.box.max.z : n.box.min.z);
+                Vec3 near(p.x > 0 ? n.box.min.x : n.box.max.x, p.y > 0 ? n.box.min.y : n.box.max.y, p.z > 0 ? n.box.min.z : n.box.max.z);
+                if (p.x * far.x + p.y * far.y + p.z * far.z + p.w < 0) {
+                    outside = true;
+                    break;
+                }
+                if (p.x * near.x + p.y * near.y + p.z * near.z + p.w >= 0)
+                    mask &= ~(1 << i);
+            }
+            if (outside) continue;
+
+            if (n.item != -1) {
+                visit(n.item);
+            } else {
+                stack.push_back({n.right, mask});
+                stack.push_back({n.left, mask});
+            }
+        }
+    }
+
+    // Distance at which the ray enters the box, or -1 if it misses within max_distance
+    float enter_distance(const BoundingBox &box, Vec3 origin, Vec3 inv_direction, float max_distance) {
+        Vec3 t0 = (box.min - origin) * inv_direction;
+        Vec3 t1 = (box.max - origin) * inv_direction;
+        float t_enter = fmax(fmax(fmin(t0.x, t1.x), fmin(t0.y, t1.y)), fmax(fmin(t0.z, t1.z), 0.0f));
+        float t_exit = fmin(fmin(fmax(t0.x, t1.x), fmax(t0.y, t1.y)), fmin(fmax(t0.z, t1.z), max_distance));
+        return t_enter <= t_exit ? t_enter : -1;
+    }
+
+    void BVH::query_ray(Vec3 origin, Vec3 direction, float max_distance, std::function<float(int, float)> visit) const {
+        if (this->_nodes.empty()) return;
+
+        // Keep axis-parallel rays away from infinities, which fast math does not promise to handle
+        auto inverse = [](float d) { return 1 / (fabs(d) > 1e-20f ? d : copysign(1e-20f, d)); };
+        Vec3 inv_direction(inverse(direction.x), inverse(direction.y), inverse(direction.z));
+        float t = enter_distance(this->_nodes[0].box, origin, inv_direction, max_distance);
+        if (t < 0) return;
+
+        std::vector<std::pair<int, float>> stack = {{0, t}};
+        while (!stack.empty()) {
+            auto [node, t_enter] = stack.back();
+            stack.pop_back();
+            if (t_enter > max_distance) continue;
+
+            const BVHNode &n = this->_nodes[node];
+            if (n.item != -1) {
+                max_distance = fmin(max_distance, visit(n.item, max_distance));
+                continue;
+            }
+            float t_left = enter_distance(this->_nodes[n.left].box, origin, inv_direction, max_distance);
+            float t_right = enter_distance(this->_nodes[n.right].box, origin, inv_direction, max_distance);
+            // Push the farther child first so the nearer one is searched first
+            bool left_first = t_right < 0 || (t_left >= 0 && t_left <= t_right);
+            if (left_first) {
+                if (t_right >= 0) stack.push_back({n.right, t_right});
+                if (t_left >= 0) stack.push_back({n.left, t_left});
+            } else {
+                if (t_left >= 0) stack.push_back({n.left, t_left});
+                stack.push_back({n.right, t_right});
+            }
+        }
+    }
+}
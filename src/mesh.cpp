@@ -1,106 +1,1038 @@
 #include "mesh.h"
 #include "texture.h"
+#include "thread_pool.h"
 #include "vec3.h"
 
+#include <algorithm>
 #include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <sstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <cstdio>
 #include <vector>
 
+#ifndef __MINGW32__
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 namespace proxima {
-    Mesh Mesh::smooth() {
-        Mesh mesh = *this;
-        mesh._has_normal = true;
-        mesh._vertex_normals.clear();
-        std::vector<std::vector<Vec3>> vn_table(mesh._vertices.size());
-        for (std::array<int, 9> &face_index : mesh._face_indices) {
-            Vec3 a = mesh._vertices[face_index[0]];
-            Vec3 b = mesh._vertices[face_index[1]];
-            Vec3 c = mesh._vertices[face_index[2]];
-            Vec3 normal = cross(b-a, c-a).normalized();
-            vn_table[face_index[0]].push_back(normal);
-            vn_table[face_index[1]].push_back(normal);
-            vn_table[face_index[2]].push_back(normal);
-            for (int i=0; i<3; i++) {
-                face_index[i+3] = face_index[i];
+    // Meshes loaded or generated so far, kept for as long as some handle is alive
+    std::map<std::string, std::weak_ptr<const MeshData>> mesh_cache;
+    std::mutex mesh_cache_mutex;
+
+    std::shared_ptr<const MeshData> find_cached_mesh(std::string key) {
+        std::lock_guard<std::mutex> lock(mesh_cache_mutex);
+        auto entry = mesh_cache.find(key);
+        return entry == mesh_cache.end() ? nullptr : entry->second.lock();
+    }
+
+    // Built outside the lock, so if two threads race the first one to finish wins
+    std::shared_ptr<const MeshData> cache_mesh(std::string key, MeshData &&mesh) {
+        std::lock_guard<std::mutex> lock(mesh_cache_mutex);
+        std::shared_ptr<const MeshData> data = mesh_cache[key].lock();
+        if (!data) {
+            data = std::make_shared<const MeshData>(std::move(mesh));
+            mesh_cache[key] = data;
+        }
+        return data;
+    }
+
+    // Shared by the loaders and generators, so that rebuilding a surface every frame does not
+    // start threads every time. A caller finding it busy, as from inside one of its own tasks
+    // or from another thread, runs the tasks itself.
+    ThreadPool &mesh_pool() {
+        static ThreadPool pool;
+        return pool;
+    }
+    std::mutex mesh_pool_mutex;
+
+    void parallel_for(int num_tasks, std::function<void(int)> task) {
+        std::unique_lock<std::mutex> lock(mesh_pool_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            for (int i=0; i<num_tasks; i++) {
+                task(i);
+            }
+            return;
+        }
+        mesh_pool().run(num_tasks, task);
+    }
+
+    class CornerHash {
+    public:
+        size_t operator()(const std::array<int, 3> &corner) const {
+            uint64_t h = (uint32_t)corner[0];
+            h = h * 0x9e3779b97f4a7c15ull + (uint32_t)corner[1];
+            h = h * 0x9e3779b97f4a7c15ull + (uint32_t)corner[2];
+            return h ^ (h >> 32);
+        }
+    };
+
+    std::shared_ptr<const MeshBuffers> build_buffers(const MeshData &data) {
+        std::shared_ptr<MeshBuffers> buffers = std::make_shared<MeshBuffers>();
+        buffers->indices.reserve(data.face_indices.size() * 3);
+        if (data.has_normal) {
+            // Corners sharing position, normal and uv share a vertex. Files mixing face formats
+            // can leave a corner without a normal, which then gets its own carrying the face normal.
+            std::unordered_map<std::array<int, 3>, uint32_t, CornerHash> vertex_table;
+            vertex_table.reserve(data.vertices.size());
+            buffers->vertices.reserve(data.vertices.size());
+            for (const std::array<int, 9> &face_index : data.face_indices) {
+                for (int i=0; i<3; i++) {
+                    int vi = face_index[i];
+                    int ni = face_index[i+3];
+                    int ti = (data.has_uv ? face_index[i+6] : -1);
+                    Vec3 t = (ti != -1 ? data.uv_coordinates[ti] : Vec3());
+                    if (ni == -1) {
+                        Vec3 a = data.vertices[face_index[0]];
+                        Vec3 normal = cross(data.vertices[face_index[1]] - a, data.vertices[face_index[2]] - a).normalized();
+                        buffers->indices.push_back(buffers->vertices.size());
+                        buffers->vertices.push_back(BufferVertex(data.vertices[vi], normal, t));
+                        continue;
+                    }
+                    auto [entry, inserted] = vertex_table.insert({{vi, ni, ti}, (uint32_t)buffers->vertices.size()});
+                    if (inserted)
+                        buffers->vertices.push_back(BufferVertex(data.vertices[vi], data.vertex_normals[ni], t));
+                    buffers->indices.push_back(entry->second);
+                }
+            }
+        } else {
+            // Flat shading, so every face gets its own corners carrying the face normal. Those
+            // land at three times the face index, so blocks of faces are filled independently.
+            int num_faces = data.face_indices.size();
+            buffers->vertices.resize(num_faces * 3);
+            buffers->indices.resize(num_faces * 3);
+            int num_blocks = (num_faces + 16383) / 16384;
+            parallel_for(num_blocks, [&](int block) {
+                for (int f=block*16384; f<std::min(num_faces, (block+1)*16384); f++) {
+                    const std::array<int, 9> &face_index = data.face_indices[f];
+                    std::array<Vec3, 3> vs;
+                    for (int i=0; i<3; i++) {
+                        vs[i] = data.vertices[face_index[i]];
+                    }
+                    Vec3 normal = cross(vs[1]-vs[0], vs[2]-vs[0]).normalized();
+                    for (int i=0; i<3; i++) {
+                        Vec3 uv = data.has_uv && face_index[i+6] != -1 ? data.uv_coordinates[face_index[i+6]] : Vec3();
+                        buffers->indices[f*3+i] = f*3+i;
+                        buffers->vertices[f*3+i] = BufferVertex(vs[i], normal, uv);
+                    }
+                }
+            });
+        }
+
+        // Bounds of the mesh, with the sphere centered on the box
+        BoundingBox &box = buffers->bounding_box;
+        BoundingSphere &sphere = buffers->bounding_sphere;
+        box.min = data.vertices.empty() ? Vec3() : data.vertices[0];
+        box.max = box.min;
+        for (const Vec3 &v : data.vertices) {
+            box.min = Vec3(fmin(box.min.x, v.x), fmin(box.min.y, v.y), fmin(box.min.z, v.z));
+            box.max = Vec3(fmax(box.max.x, v.x), fmax(box.max.y, v.y), fmax(box.max.z, v.z));
+        }
+        sphere.center = (box.min + box.max) / 2;
+        sphere.radius = 0;
+        for (const Vec3 &v : data.vertices) {
+            Vec3 offset = v - sphere.center;
+            sphere.radius = fmax(sphere.radius, dot(offset, offset));
+        }
+        sphere.radius = sqrt(sphere.radius);
+        return buffers;
+    }
+
+    const MeshBuffers &Mesh::buffers() const {
+        const MeshData &data = *this->_data;
+        return data.buffers.get([&] { return build_buffers(data); });
+    }
+
+    Mesh Mesh::smooth(bool weld_positions) const {
+        MeshData mesh = *this->_data;
+        mesh.has_normal = true;
+        int num_vertices = mesh.vertices.size();
+        int num_faces = mesh.face_indices.size();
+
+        // Welding makes every copy of a position add into, and read back, the first one's sum
+        std::vector<int> target(num_vertices);
+        if (weld_positions) {
+            std::unordered_map<std::array<int, 3>, int, CornerHash> first;
+            first.reserve(num_vertices);
+            for (int v=0; v<num_vertices; v++) {
+                std::array<int, 3> bits;
+                memcpy(bits.data(), &mesh.vertices[v], sizeof(bits));
+                target[v] = first.insert({bits, v}).first->second;
+            }
+        } else {
+            for (int v=0; v<num_vertices; v++) {
+                target[v] = v;
             }
         }
-        for (int i=0; i<(int)mesh._vertices.size(); i++) {
-            Vec3 sum = Vec3(0, 0, 0);
-            for (Vec3 normal : vn_table[i]) {
-                sum += normal;
+
+        // Each range of faces sums its area weighted normals into its own array, the cross
+        // product being twice the area, and the arrays are then added up by vertex ranges
+        int num_ranges = std::max(1, std::min(mesh_pool().num_threads(), num_faces / 65536));
+        std::vector<std::vector<Vec3>> sums(num_ranges);
+        parallel_for(num_ranges, [&](int r) {
+            std::vector<Vec3> &sum = sums[r];
+            sum.assign(num_vertices, Vec3());
+            for (int f=(int64_t)num_faces*r/num_ranges; f<(int64_t)num_faces*(r+1)/num_ranges; f++) {
+                std::array<int, 9> &face_index = mesh.face_indices[f];
+                Vec3 a = mesh.vertices[face_index[0]];
+                Vec3 normal = cross(mesh.vertices[face_index[1]] - a, mesh.vertices[face_index[2]] - a);
+                for (int i=0; i<3; i++) {
+                    sum[target[face_index[i]]] += normal;
+                    face_index[i+3] = face_index[i];
+                }
+            }
+        });
+        mesh.vertex_normals.resize(num_vertices);
+        parallel_for(num_ranges, [&](int r) {
+            for (int v=(int64_t)num_vertices*r/num_ranges; v<(int64_t)num_vertices*(r+1)/num_ranges; v++) {
+                for (int k=1; k<num_ranges; k++) {
+                    sums[0][v] += sums[k][v];
+                }
+            }
+        });
+        parallel_for(num_ranges, [&](int r) {
+            for (int v=(int64_t)num_vertices*r/num_ranges; v<(int64_t)num_vertices*(r+1)/num_ranges; v++) {
+                mesh.vertex_normals[v] = sums[0][target[v]].normalized();
             }
-            mesh._vertex_normals.push_back(sum.normalized());
+        });
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
+    }
+
+    const char *skip_spaces(const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        return p;
+    }
+
+    // Leaves value alone when there is no number, as in a short "v" line
+    const char *parse_float(const char *p, const char *end, float &value) {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+') p++;
+        return std::from_chars(p, end, value).ptr;
+    }
+
+    // One of the "v", "v/t", "v//n" or "v/t/n" corners of a face, with each index made
+    // zero based. Negative indices count back from the last element read so far, and
+    // missing ones come out as -1.
+    const char *parse_corner(const char *p, const char *end, const std::array<int, 3> &counts, std::array<int, 3> &corner) {
+        corner = {-1, -1, -1};
+        for (int k=0; k<3; k++) {
+            int index = 0;
+            p = std::from_chars(p + (k > 0 && p < end && *p == '/'), end, index).ptr;
+            if (index != 0) corner[k] = index > 0 ? index - 1 : counts[k] + index;
+            if (p >= end || *p != '/') break;
         }
-        return mesh;
+        return p;
     }
 
-    Mesh::Mesh(std::string filename) : Mesh() {
-        std::ifstream infile(filename);
-        std::string line;
-        while (std::getline(infile, line)) {
-            std::istringstream iss(line);
-            std::string cmd;
-            iss >> cmd;
+    // Part of an OBJ file cut at line ends, along with where its elements go in the whole
+    class ObjChunk {
+    public:
+        const char *begin;
+        const char *end;
+        std::array<int, 3> counts; // Vertices, normals and uvs defined in the chunk
+        std::array<int, 3> first;  // The same defined before it
+        std::vector<std::array<int, 9>> faces;
+    };
+
+    // Calls visit with the command and the rest of every line in a chunk
+    template <typename F>
+    void for_each_line(const ObjChunk &chunk, F visit) {
+        const char *p = chunk.begin;
+        while (p < chunk.end) {
+            const char *line_end = (const char*)memchr(p, '\n', chunk.end - p);
+            if (!line_end) line_end = chunk.end;
+            const char *cmd = skip_spaces(p, line_end);
+            const char *cmd_end = cmd;
+            while (cmd_end < line_end && *cmd_end != ' ' && *cmd_end != '\t' && *cmd_end != '\r') cmd_end++;
+            visit(std::string_view(cmd, cmd_end - cmd), cmd_end, line_end);
+            p = line_end + 1;
+        }
+    }
+
+    void parse_obj_chunk(ObjChunk &chunk, MeshData &mesh) {
+        std::array<int, 3> counts = chunk.first;
+        std::vector<std::array<int, 3>> corners;
+        for_each_line(chunk, [&](std::string_view cmd, const char *p, const char *end) {
             if (cmd == "v") {
-                float x, y, z;
-                iss >> x >> y >> z;
-                this->_vertices.push_back(Vec3(x, y, z));
-            }
-            if (cmd == "vn") {
-                this->_has_normal = true;
-                float x, y, z;
-                iss >> x >> y >> z;
-                this->_vertex_normals.push_back(Vec3(x, y, z).normalized());
-            }
-            if (cmd == "vt") {
-                this->_has_uv = true;
-                float u, v;
-                iss >> u >> v;
-                this->_uv_coordinates.push_back(Vec3(u, v, 0));
-            }
-            if (cmd == "f") {
-                if (this->_has_normal || this->_has_uv) {
-                    std::array<int, 9> indices;
-                    for (int i=0; i<3; i++) {
-                        std::string index_pair;
-                        iss >> index_pair;
-                        int vertex, normal, uv;
-                        if (this->_has_normal && !(this->_has_uv))
-                            sscanf(index_pair.c_str(), "%d//%d", &vertex, &normal);
-                        if (!(this->_has_normal) && this->_has_uv)
-                            sscanf(index_pair.c_str(), "%d/%d", &vertex, &uv);
-                        if (this->_has_normal && this->_has_uv)
-                            sscanf(index_pair.c_str(), "%d/%d/%d", &vertex, &uv, &normal);
-                        indices[i] = vertex - 1;
-                        indices[i+3] = normal - 1;
-                        indices[i+6] = uv - 1;
+                Vec3 &v = mesh.vertices[counts[0]++];
+                p = parse_float(p, end, v.x);
+                p = parse_float(p, end, v.y);
+                parse_float(p, end, v.z);
+            } else if (cmd == "vn") {
+                Vec3 n;
+                p = parse_float(p, end, n.x);
+                p = parse_float(p, end, n.y);
+                parse_float(p, end, n.z);
+                mesh.vertex_normals[counts[1]++] = n.normalized();
+            } else if (cmd == "vt") {
+                Vec3 &t = mesh.uv_coordinates[counts[2]++];
+                p = parse_float(p, end, t.x);
+                parse_float(p, end, t.y);
+            } else if (cmd == "f") {
+                corners.clear();
+                while ((p = skip_spaces(p, end)) < end && *p != '\r') {
+                    std::array<int, 3> corner;
+                    p = parse_corner(p, end, {counts[0], counts[2], counts[1]}, corner);
+                    if (corner[0] != -1) corners.push_back(corner);
+                    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+                }
+                // Quads and larger polygons are split into a fan around the first corner
+                for (int i=2; i<(int)corners.size(); i++) {
+                    const std::array<int, 3> &a = corners[0];
+                    const std::array<int, 3> &b = corners[i-1];
+                    const std::array<int, 3> &c = corners[i];
+                    chunk.faces.push_back({a[0], b[0], c[0], a[2], b[2], c[2], a[1], b[1], c[1]});
+                }
+            }
+        });
+    }
+
+    // Merges bitwise equal values, returning where each old one went
+    std::vector<int> weld(std::vector<Vec3> &values) {
+        std::unordered_map<std::array<int, 3>, int, CornerHash> table;
+        std::vector<int> remap(values.size());
+        std::vector<Vec3> welded;
+        for (int i=0; i<(int)values.size(); i++) {
+            std::array<int, 3> bits;
+            memcpy(bits.data(), &values[i], sizeof(bits));
+            auto [entry, inserted] = table.insert({bits, (int)welded.size()});
+            if (inserted) welded.push_back(values[i]);
+            remap[i] = entry->second;
+        }
+        values = std::move(welded);
+        return remap;
+    }
+
+    // Tipsify (Sander, Nehab and Barczak 2007): fans out around one vertex at a time, moving
+    // on to a neighbour still in a cache of cache_size vertices where there is one. Returns
+    // the order the triangles go in.
+    std::vector<int> tipsify(const std::vector<uint32_t> &indices, int num_vertices, int cache_size) {
+        int num_faces = indices.size() / 3;
+        std::vector<int> live(num_vertices, 0);
+        for (uint32_t v : indices) {
+            live[v]++;
+        }
+        std::vector<int> first(num_vertices + 1, 0);
+        for (int v=0; v<num_vertices; v++) {
+            first[v+1] = first[v] + live[v];
+        }
+        std::vector<int> adjacency(indices.size());
+        std::vector<int> fill(first.begin(), first.end() - 1);
+        for (int i=0; i<(int)indices.size(); i++) {
+            adjacency[fill[indices[i]]++] = i / 3;
+        }
+
+        std::vector<int> order;
+        order.reserve(num_faces);
+        std::vector<bool> emitted(num_faces, false);
+        std::vector<int> cache_time(num_vertices, 0);
+        std::vector<int> dead_ends;
+        std::vector<int> candidates;
+        int time = cache_size + 1;
+        int cursor = 0;
+        int fan = num_vertices > 0 ? 0 : -1;
+        while (fan != -1) {
+            candidates.clear();
+            for (int k=first[fan]; k<first[fan+1]; k++) {
+                int face = adjacency[k];
+                if (emitted[face]) continue;
+                emitted[face] = true;
+                order.push_back(face);
+                for (int i=0; i<3; i++) {
+                    int v = indices[face * 3 + i];
+                    dead_ends.push_back(v);
+                    candidates.push_back(v);
+                    live[v]--;
+                    if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+                }
+            }
+
+            // The candidate that will still be in the cache after its own fan, oldest first
+            fan = -1;
+            int best_priority = -1;
+            for (int v : candidates) {
+                if (live[v] == 0) continue;
+                int priority = 0;
+                if (time - cache_time[v] + 2 * live[v] <= cache_size) priority = time - cache_time[v];
+                if (priority > best_priority) {
+                    best_priority = priority;
+                    fan = v;
+                }
+            }
+            // Otherwise back up to a recent vertex with faces left, or the next one in order
+            while (fan == -1 && !dead_ends.empty()) {
+                int v = dead_ends.back();
+                dead_ends.pop_back();
+                if (live[v] > 0) fan = v;
+            }
+            while (fan == -1 && cursor < num_vertices) {
+                if (live[cursor] > 0) fan = cursor;
+                cursor++;
+            }
+        }
+        return order;
+    }
+
+    // Renumbers the entries of one attribute of the faces in the order they are first used,
+    // dropping the ones no face uses
+    void reorder_by_first_use(std::vector<std::array<int, 9>> &faces, int attribute, std::vector<Vec3> &values) {
+        std::vector<int> remap(values.size(), -1);
+        std::vector<Vec3> reordered;
+        reordered.reserve(values.size());
+        for (std::array<int, 9> &face_index : faces) {
+            for (int i=0; i<3; i++) {
+                int &index = face_index[attribute * 3 + i];
+                if (index == -1) continue;
+                if (remap[index] == -1) {
+                    remap[index] = reordered.size();
+                    reordered.push_back(values[index]);
+                }
+                index = remap[index];
+            }
+        }
+        values = std::move(reordered);
+    }
+
+    Mesh Mesh::optimize(int cache_size) const {
+        MeshData mesh = *this->_data;
+        if (!mesh.has_normal) mesh.vertex_normals.clear();
+        if (!mesh.has_uv) mesh.uv_coordinates.clear();
+
+        // Weld each attribute, dropping the faces welding leaves without area
+        std::vector<int> vertex_remap = weld(mesh.vertices);
+        std::vector<int> normal_remap = weld(mesh.vertex_normals);
+        std::vector<int> uv_remap = weld(mesh.uv_coordinates);
+        std::vector<std::array<int, 9>> faces;
+        faces.reserve(mesh.face_indices.size());
+        for (std::array<int, 9> face_index : mesh.face_indices) {
+            for (int i=0; i<3; i++) {
+                face_index[i] = vertex_remap[face_index[i]];
+                face_index[i+3] = mesh.has_normal && face_index[i+3] != -1 ? normal_remap[face_index[i+3]] : -1;
+                face_index[i+6] = mesh.has_uv && face_index[i+6] != -1 ? uv_remap[face_index[i+6]] : -1;
+            }
+            if (face_index[0] == face_index[1] || face_index[1] == face_index[2] || face_index[2] == face_index[0])
+                continue;
+            faces.push_back(face_index);
+        }
+
+        // Order the faces by the corners the renderer will share between them
+        std::unordered_map<std::array<int, 3>, uint32_t, CornerHash> corner_table;
+        std::vector<uint32_t> corners;
+        corners.reserve(faces.size() * 3);
+        for (const std::array<int, 9> &face_index : faces) {
+            for (int i=0; i<3; i++) {
+                auto entry = corner_table.insert({{face_index[i], face_index[i+3], face_index[i+6]}, (uint32_t)corner_table.size()});
+                corners.push_back(entry.first->second);
+            }
+        }
+        std::vector<int> order = tipsify(corners, corner_table.size(), cache_size);
+        mesh.face_indices.clear();
+        for (int face : order) {
+            mesh.face_indices.push_back(faces[face]);
+        }
+
+        // Then lay every attribute out in the order the faces reach it
+        reorder_by_first_use(mesh.face_indices, 0, mesh.vertices);
+        reorder_by_first_use(mesh.face_indices, 1, mesh.vertex_normals);
+        reorder_by_first_use(mesh.face_indices, 2, mesh.uv_coordinates);
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
+    }
+
+    float Mesh::cache_miss_ratio(int cache_size) const {
+        const std::vector<uint32_t> &indices = this->buffers().indices;
+        if (indices.empty()) return 0;
+
+        // FIFO cache as in the post-transform caches of GPUs
+        std::vector<int> cached_at(this->buffers().vertices.size(), -1);
+        int misses = 0;
+        for (uint32_t v : indices) {
+            if (cached_at[v] == -1 || misses - cached_at[v] >= cache_size) {
+                cached_at[v] = misses;
+                misses++;
+            }
+        }
+        return (float)misses / (indices.size() / 3);
+    }
+
+    // Sum of squared distances to a set of planes, as the upper triangle of a 4x4 matrix
+    class Quadric {
+    public:
+        std::array<double, 10> q;
+        Quadric() : q() {}
+        Quadric(Vec3 n, float d) : q({n.x*n.x, n.x*n.y, n.x*n.z, n.x*d, n.y*n.y, n.y*n.z, n.y*d, n.z*n.z, n.z*d, (double)d*d}) {}
+        Quadric &operator+=(const Quadric &other) {
+            for (int i=0; i<10; i++) this->q[i] += other.q[i];
+            return *this;
+        }
+        double error(Vec3 p) const {
+            const std::array<double, 10> &q = this->q;
+            double x = p.x, y = p.y, z = p.z;
+            return x*x*q[0] + 2*x*y*q[1] + 2*x*z*q[2] + 2*x*q[3] + y*y*q[4] + 2*y*z*q[5] + 2*y*q[6] + z*z*q[7] + 2*z*q[8] + q[9];
+        }
+    };
+
+    // Distance from p to the closest point of triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+    float point_triangle_distance(Vec3 p, Vec3 a, Vec3 b, Vec3 c) {
+        Vec3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0) return ap.magnitude();
+        Vec3 bp = p - b;
+        float d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3) return bp.magnitude();
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) return (p - (a + ab * (d1 / (d1 - d3)))).magnitude();
+        Vec3 cp = p - c;
+        float d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6) return cp.magnitude();
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) return (p - (a + ac * (d2 / (d2 - d6)))).magnitude();
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return (p - (b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))))).magnitude();
+        float denom = 1 / (va + vb + vc);
+        return (p - (a + ab * (vb * denom) + ac * (vc * denom))).magnitude();
+    }
+
+    class Collapse {
+    public:
+        double cost;
+        int from;
+        int to;
+        int from_version;
+        int to_version;
+        bool operator>(const Collapse &other) const { return this->cost > other.cost; }
+    };
+
+    Mesh Mesh::simplify(int target_faces) const {
+        MeshData mesh = *this->optimize()._data;
+        std::vector<std::array<int, 9>> &faces = mesh.face_indices;
+        int num_vertices = mesh.vertices.size();
+        int num_faces = faces.size();
+        if (num_faces <= target_faces) return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
+
+        std::vector<std::vector<int>> vertex_faces(num_vertices);
+        std::vector<Quadric> quadrics(num_vertices);
+        for (int f=0; f<num_faces; f++) {
+            // Zero-area faces, common enough in files, have no plane and add nothing
+            Vec3 a = mesh.vertices[faces[f][0]];
+            Vec3 normal = cross(mesh.vertices[faces[f][1]] - a, mesh.vertices[faces[f][2]] - a);
+            float area = normal.magnitude();
+            Quadric plane;
+            if (area > 0) {
+                normal /= area;
+                plane = Quadric(normal, -dot(normal, a));
+            }
+            for (int i=0; i<3; i++) {
+                vertex_faces[faces[f][i]].push_back(f);
+                quadrics[faces[f][i]] += plane;
+            }
+        }
+
+        // Vertices on a border, a non-manifold edge or a seam between normals or uvs stay put,
+        // which keeps the outline and the seams as they are. Normals a few degrees apart, as
+        // where patches meet, don't make a seam.
+        auto same_corner = [&](std::pair<int, int> a, std::pair<int, int> b) {
+            if (a.second != b.second) return false;
+            if (a.first == b.first) return true;
+            return a.first != -1 && b.first != -1 && dot(mesh.vertex_normals[a.first], mesh.vertex_normals[b.first]) > 0.99f;
+        };
+        std::vector<bool> locked(num_vertices, false);
+        std::vector<std::pair<int, int>> attributes(num_vertices, {-2, -2});
+        std::map<std::pair<int, int>, int> edge_faces;
+        for (int f=0; f<num_faces; f++) {
+            for (int i=0; i<3; i++) {
+                int v = faces[f][i];
+                std::pair<int, int> corner = {faces[f][i+3], faces[f][i+6]};
+                if (attributes[v].first == -2) attributes[v] = corner;
+                else if (!same_corner(attributes[v], corner)) locked[v] = true;
+                int w = faces[f][(i+1) % 3];
+                edge_faces[{std::min(v, w), std::max(v, w)}]++;
+            }
+        }
+        for (auto &[edge, count] : edge_faces) {
+            if (count != 2) locked[edge.first] = locked[edge.second] = true;
+        }
+
+        std::vector<int> version(num_vertices, 0);
+        std::vector<int> collapsed_to(num_vertices, -1);
+        std::vector<bool> alive(num_faces, true);
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+        auto push_edges = [&](int v) {
+            for (int f : vertex_faces[v]) {
+                if (!alive[f]) continue;
+                for (int i=0; i<3; i++) {
+                    int w = faces[f][i];
+                    if (w == v) continue;
+                    Quadric q = quadrics[v];
+                    q += quadrics[w];
+                    if (!locked[v]) heap.push({q.error(mesh.vertices[w]), v, w, version[v], version[w]});
+                    if (!locked[w]) heap.push({q.error(mesh.vertices[v]), w, v, version[w], version[v]});
+                }
+            }
+        };
+        for (int v=0; v<num_vertices; v++) {
+            push_edges(v);
+        }
+
+        std::vector<int> neighbours;
+        while (num_faces > target_faces && !heap.empty()) {
+            Collapse c = heap.top();
+            heap.pop();
+            if (c.from_version != version[c.from] || c.to_version != version[c.to]) continue;
+            int u = c.from;
+            int v = c.to;
+
+            // The corners moving to v take on its normal and uv where they meet it, so they
+            // must agree on those across the edge
+            std::pair<int, int> to_attributes = {-2, -2};
+            bool valid = true;
+            neighbours.clear();
+            for (int f : vertex_faces[u]) {
+                if (!alive[f]) continue;
+                for (int i=0; i<3; i++) {
+                    if (faces[f][i] != v) {
+                        if (faces[f][i] != u) neighbours.push_back(faces[f][i]);
+                        continue;
                     }
-                    this->_face_indices.push_back(indices);
-                } else {
-                    int a, b, c;
-                    iss >> a >> b >> c;
-                    this->_face_indices.push_back({a-1, b-1, c-1});
+                    std::pair<int, int> corner = {faces[f][i+3], faces[f][i+6]};
+                    if (to_attributes.first == -2) to_attributes = corner;
+                    else if (!same_corner(to_attributes, corner)) valid = false;
+                }
+            }
+            if (!valid || to_attributes.first == -2) continue;
+
+            // Only the two faces on the edge may share a third vertex, or the surface would fold
+            int shared = 0;
+            std::sort(neighbours.begin(), neighbours.end());
+            neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+            for (int f : vertex_faces[v]) {
+                if (!alive[f]) continue;
+                for (int i=0; i<3; i++) {
+                    int w = faces[f][i];
+                    if (w != u && w != v && std::binary_search(neighbours.begin(), neighbours.end(), w)) {
+                        shared++;
+                        neighbours.erase(std::lower_bound(neighbours.begin(), neighbours.end(), w));
+                    }
+                }
+            }
+            if (shared > 2) continue;
+
+            // Nor may any face left around u turn over
+            for (int f : vertex_faces[u]) {
+                if (!alive[f]) continue;
+                const std::array<int, 9> &face = faces[f];
+                if (face[0] == v || face[1] == v || face[2] == v) continue;
+                std::array<Vec3, 3> ps;
+                std::array<Vec3, 3> moved;
+                for (int i=0; i<3; i++) {
+                    ps[i] = mesh.vertices[face[i]];
+                    moved[i] = face[i] == u ? mesh.vertices[v] : ps[i];
+                }
+                Vec3 before = cross(ps[1] - ps[0], ps[2] - ps[0]);
+                Vec3 after = cross(moved[1] - moved[0], moved[2] - moved[0]);
+                if (dot(before, after) <= 0.2f * before.magnitude() * after.magnitude()) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (!valid) continue;
+
+            for (int f : vertex_faces[u]) {
+                if (!alive[f]) continue;
+                std::array<int, 9> &face = faces[f];
+                if (face[0] == v || face[1] == v || face[2] == v) {
+                    alive[f] = false;
+                    num_faces--;
+                    continue;
                 }
+                for (int i=0; i<3; i++) {
+                    if (face[i] != u) continue;
+                    face[i] = v;
+                    face[i+3] = to_attributes.first;
+                    face[i+6] = to_attributes.second;
+                }
+                vertex_faces[v].push_back(f);
+            }
+            vertex_faces[u].clear();
+            collapsed_to[u] = v;
+            quadrics[v] += quadrics[u];
+            version[u]++;
+            version[v]++;
+            push_edges(v);
+        }
+
+        // Measure the error as the furthest any original vertex ends up from the faces around
+        // the vertex it was collapsed into
+        float error = 0;
+        for (int u=0; u<num_vertices; u++) {
+            int v = u;
+            while (collapsed_to[v] != -1) v = collapsed_to[v];
+            if (v == u) continue;
+            float distance = std::numeric_limits<float>::max();
+            for (int f : vertex_faces[v]) {
+                if (!alive[f]) continue;
+                distance = fmin(distance, point_triangle_distance(mesh.vertices[u],
+                    mesh.vertices[faces[f][0]], mesh.vertices[faces[f][1]], mesh.vertices[faces[f][2]]));
+            }
+            if (distance != std::numeric_limits<float>::max()) error = fmax(error, distance);
+        }
+
+        std::vector<std::array<int, 9>> kept;
+        for (int f=0; f<(int)faces.size(); f++) {
+            if (alive[f]) kept.push_back(faces[f]);
+        }
+        faces = std::move(kept);
+        mesh.error = std::max(mesh.error, error);
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh))).optimize();
+    }
+
+    std::vector<Mesh> Mesh::lod_chain(int min_faces) const {
+        // Each level halves the faces of the one before, simplifying the original every time
+        // so the errors don't stack up
+        std::vector<Mesh> chain;
+        int faces = this->face_indices().size();
+        while (faces / 2 >= min_faces) {
+            Mesh lod = this->simplify(faces / 2);
+            int lod_faces = lod.face_indices().size();
+            // Stop once the locked vertices leave little left to take away
+            if (lod_faces > faces * 3 / 4) break;
+            chain.push_back(lod);
+            faces = lod_faces;
+        }
+        return chain;
+    }
+
+    // A whole file in memory, mapped where the platform allows and read in otherwise
+    class MappedFile {
+    private:
+        std::string _contents;
+        bool _mapped;
+
+    public:
+        const char *data;
+        size_t size;
+        MappedFile(std::string filename);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile &operator=(const MappedFile&) = delete;
+    };
+
+    MappedFile::MappedFile(std::string filename) {
+        this->_mapped = false;
+        this->data = nullptr;
+        this->size = 0;
+#ifndef __MINGW32__
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd != -1 && fstat(fd, &info) == 0 && info.st_size > 0) {
+            void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                this->_mapped = true;
+                this->data = (const char*)mapped;
+                this->size = info.st_size;
+            }
+        }
+        if (fd != -1) close(fd);
+#endif
+        if (!this->_mapped) {
+            std::ifstream infile(filename, std::ios::binary);
+            this->_contents.assign(std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>());
+            this->data = this->_contents.data();
+            this->size = this->_contents.size();
+        }
+    }
+
+    MappedFile::~MappedFile() {
+#ifndef __MINGW32__
+        if (this->_mapped) munmap((void*)this->data, this->size);
+#endif
+    }
+
+    void parse_obj(const char *text, size_t size, MeshData &mesh) {
+        // Cut the file into a few chunks per thread at line ends
+        int num_chunks = std::max<size_t>(1, std::min<size_t>(mesh_pool().num_threads() * 4, size / (1 << 16)));
+        std::vector<ObjChunk> chunks(num_chunks);
+        const char *p = text;
+        for (int i=0; i<num_chunks; i++) {
+            const char *end = i == num_chunks - 1 ? text + size : text + size * (i + 1) / num_chunks;
+            end = std::max(end, p);
+            const char *line_end = (const char*)memchr(end, '\n', text + size - end);
+            end = line_end ? line_end + 1 : text + size;
+            chunks[i].begin = p;
+            chunks[i].end = end;
+            p = end;
+        }
+
+        // Count the elements of every chunk first, so they can all be parsed straight into place
+        parallel_for(num_chunks, [&](int i) {
+            ObjChunk &chunk = chunks[i];
+            chunk.counts = {0, 0, 0};
+            for_each_line(chunk, [&](std::string_view cmd, const char*, const char*) {
+                if (cmd == "v") chunk.counts[0]++;
+                else if (cmd == "vn") chunk.counts[1]++;
+                else if (cmd == "vt") chunk.counts[2]++;
+            });
+        });
+        std::array<int, 3> total = {0, 0, 0};
+        for (ObjChunk &chunk : chunks) {
+            chunk.first = total;
+            for (int k=0; k<3; k++) {
+                total[k] += chunk.counts[k];
+            }
+        }
+
+        mesh.vertices.resize(total[0]);
+        mesh.vertex_normals.resize(total[1]);
+        mesh.uv_coordinates.resize(total[2]);
+        mesh.has_normal = total[1] > 0;
+        mesh.has_uv = total[2] > 0;
+        parallel_for(num_chunks, [&](int i) {
+            parse_obj_chunk(chunks[i], mesh);
+        });
+
+        size_t num_faces = 0;
+        for (const ObjChunk &chunk : chunks) {
+            num_faces += chunk.faces.size();
+        }
+        mesh.face_indices.reserve(num_faces);
+        for (const ObjChunk &chunk : chunks) {
+            mesh.face_indices.insert(mesh.face_indices.end(), chunk.faces.begin(), chunk.faces.end());
+        }
+    }
+
+    const char MESH_FILE_MAGIC[8] = {'P', 'R', 'O', 'X', 'M', 'E', 'S', 'H'};
+    const uint32_t MESH_FILE_VERSION = 1;
+
+    // Start of a cooked mesh file. The sections follow at 64 byte aligned offsets in the order
+    // of MeshSection, each holding a plain array of the matching MeshData or MeshBuffers field.
+    enum MeshSection {
+        SECTION_VERTICES,
+        SECTION_NORMALS,
+        SECTION_UVS,
+        SECTION_FACES,
+        SECTION_BUFFER_VERTICES,
+        SECTION_BUFFER_INDICES,
+        NUM_SECTIONS
+    };
+
+    class MeshFileHeader {
+    public:
+        char magic[8];
+        uint32_t version;
+        uint32_t has_normal;
+        uint32_t has_uv;
+        uint32_t padding;
+        // The source the mesh was cooked from, so an edited one is noticed
+        int64_t source_time;
+        uint64_t source_size;
+        uint64_t counts[NUM_SECTIONS];
+        uint64_t offsets[NUM_SECTIONS];
+        BoundingBox bounding_box;
+        BoundingSphere bounding_sphere;
+    };
+
+    std::string Mesh::cache_directory = "./cache";
+
+    // Where the cooked copy of a source file goes, named by a hash of its absolute path,
+    // modification time and size. Empty if there is no cache or no source.
+    std::string cooked_mesh_path(std::string filename, int64_t &source_time, uint64_t &source_size) {
+        std::error_code error;
+        if (Mesh::cache_directory.empty()) return "";
+        std::filesystem::path path = std::filesystem::absolute(filename, error);
+        source_size = std::filesystem::file_size(path, error);
+        if (error) return "";
+        source_time = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        if (error) return "";
+
+        uint64_t hash = 14695981039346656037ull;
+        std::string id = path.string() + ":" + std::to_string(source_time) + ":" + std::to_string(source_size);
+        for (char c : id) {
+            hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)hash);
+        return (std::filesystem::path(Mesh::cache_directory) / name).string();
+    }
+
+    // Copies each section out in one go, after checking it is the cooked copy of the same source
+    // and that the whole section table fits in the file. Nothing reaches mesh unless all of it
+    // reads back, so a damaged file leaves it as it was.
+    bool read_cooked_mesh(std::string cooked, int64_t source_time, uint64_t source_size, MeshData &mesh) {
+        if (!std::filesystem::exists(cooked)) return false;
+        MappedFile file(cooked);
+        MeshFileHeader header;
+        if (!file.data || file.size < sizeof(header)) return false;
+        memcpy(&header, file.data, sizeof(header));
+        if (memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != MESH_FILE_VERSION)
+            return false;
+        if (header.source_time != source_time || header.source_size != source_size)
+            return false;
+
+        const size_t element_sizes[NUM_SECTIONS] = {
+            sizeof(Vec3), sizeof(Vec3), sizeof(Vec3), sizeof(std::array<int, 9>), sizeof(BufferVertex), sizeof(uint32_t)
+        };
+        for (int i=0; i<NUM_SECTIONS; i++) {
+            if (header.offsets[i] < sizeof(header) || header.offsets[i] > file.size) return false;
+            if (header.counts[i] > (file.size - header.offsets[i]) / element_sizes[i]) return false;
+        }
+
+        MeshData cooked_mesh;
+        std::shared_ptr<MeshBuffers> buffers = std::make_shared<MeshBuffers>();
+        auto read = [&](MeshSection section, auto &array) {
+            array.resize(header.counts[section]);
+            memcpy(array.data(), file.data + header.offsets[section], header.counts[section] * element_sizes[section]);
+        };
+        read(SECTION_VERTICES, cooked_mesh.vertices);
+        read(SECTION_NORMALS, cooked_mesh.vertex_normals);
+        read(SECTION_UVS, cooked_mesh.uv_coordinates);
+        read(SECTION_FACES, cooked_mesh.face_indices);
+        read(SECTION_BUFFER_VERTICES, buffers->vertices);
+        read(SECTION_BUFFER_INDICES, buffers->indices);
+
+        // An edited file can fit the table and still point outside the arrays
+        int num_vertices = cooked_mesh.vertices.size();
+        int num_normals = cooked_mesh.vertex_normals.size();
+        int num_uvs = cooked_mesh.uv_coordinates.size();
+        for (const std::array<int, 9> &face_index : cooked_mesh.face_indices) {
+            for (int i=0; i<3; i++) {
+                if (face_index[i] < 0 || face_index[i] >= num_vertices) return false;
+                if (face_index[i+3] < -1 || face_index[i+3] >= num_normals) return false;
+                if (face_index[i+6] < -1 || face_index[i+6] >= num_uvs) return false;
             }
         }
+        for (uint32_t index : buffers->indices) {
+            if (index >= buffers->vertices.size()) return false;
+        }
+
+        cooked_mesh.has_normal = header.has_normal;
+        cooked_mesh.has_uv = header.has_uv;
+        buffers->bounding_box = header.bounding_box;
+        buffers->bounding_sphere = header.bounding_sphere;
+        cooked_mesh.buffers = LazyMeshBuffers(buffers);
+        mesh = std::move(cooked_mesh);
+        return true;
+    }
+
+    // Written to a temporary name first, so a reader never sees half a file
+    void write_cooked_mesh(std::string cooked, int64_t source_time, uint64_t source_size, const MeshData &mesh, const MeshBuffers &buffers) {
+        MeshFileHeader header = {};
+        memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+        header.version = MESH_FILE_VERSION;
+        header.has_normal = mesh.has_normal;
+        header.has_uv = mesh.has_uv;
+        header.source_time = source_time;
+        header.source_size = source_size;
+        header.bounding_box = buffers.bounding_box;
+        header.bounding_sphere = buffers.bounding_sphere;
+        std::array<std::pair<const void*, size_t>, NUM_SECTIONS> sections = {{
+            {mesh.vertices.data(), mesh.vertices.size() * sizeof(Vec3)},
+            {mesh.vertex_normals.data(), mesh.vertex_normals.size() * sizeof(Vec3)},
+            {mesh.uv_coordinates.data(), mesh.uv_coordinates.size() * sizeof(Vec3)},
+            {mesh.face_indices.data(), mesh.face_indices.size() * sizeof(std::array<int, 9>)},
+            {buffers.vertices.data(), buffers.vertices.size() * sizeof(BufferVertex)},
+            {buffers.indices.data(), buffers.indices.size() * sizeof(uint32_t)}
+        }};
+        header.counts[SECTION_VERTICES] = mesh.vertices.size();
+        header.counts[SECTION_NORMALS] = mesh.vertex_normals.size();
+        header.counts[SECTION_UVS] = mesh.uv_coordinates.size();
+        header.counts[SECTION_FACES] = mesh.face_indices.size();
+        header.counts[SECTION_BUFFER_VERTICES] = buffers.vertices.size();
+        header.counts[SECTION_BUFFER_INDICES] = buffers.indices.size();
+        uint64_t offset = sizeof(header);
+        for (int i=0; i<NUM_SECTIONS; i++) {
+            offset = (offset + 63) & ~63ull;
+            header.offsets[i] = offset;
+            offset += sections[i].second;
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(Mesh::cache_directory, error);
+        std::string temporary = cooked + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return;
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (int i=0; i<NUM_SECTIONS && written; i++) {
+            written = fseek(file, header.offsets[i], SEEK_SET) == 0
+                && fwrite(sections[i].first, 1, sections[i].second, file) == sections[i].second;
+        }
+        written = fclose(file) == 0 && written;
+
+        // A cut short file would be turned down on every run after and never written again
+        if (written) std::filesystem::rename(temporary, cooked, error);
+        if (!written || error) std::filesystem::remove(temporary, error);
+    }
+
+    Mesh::Mesh(std::string filename) {
+        std::string key = "file " + filename;
+        this->_data = find_cached_mesh(key);
+        if (this->_data) return;
+
+        MeshData mesh;
+        int64_t source_time;
+        uint64_t source_size;
+        std::string cooked = cooked_mesh_path(filename, source_time, source_size);
+        if (!cooked.empty() && read_cooked_mesh(cooked, source_time, source_size, mesh)) {
+            this->_data = cache_mesh(key, std::move(mesh));
+            return;
+        }
+
+        {
+            MappedFile file(filename);
+            parse_obj(file.data, file.size, mesh);
+        }
+        this->_data = cache_mesh(key, std::move(mesh));
+        if (!cooked.empty())
+            write_cooked_mesh(cooked, source_time, source_size, *this->_data, this->buffers());
+    }
+
+    // Rows of a grid are handed out in blocks big enough to be worth a task
+    void parallel_rows(int num_rows, int row_size, std::function<void(int)> row) {
+        int rows_per_task = std::max(1, 16384 / std::max(1, row_size));
+        int num_tasks = (num_rows + rows_per_task - 1) / rows_per_task;
+        parallel_for(num_tasks, [&](int task) {
+            for (int i=task*rows_per_task; i<std::min(num_rows, (task+1)*rows_per_task); i++) {
+                row(i);
+            }
+        });
     }
 
     Mesh Mesh::Plane(int resolution) {
-        Mesh mesh;
-        mesh._has_normal = true;
-        mesh._has_uv = true;
+        std::string key = "plane " + std::to_string(resolution);
+        if (std::shared_ptr<const MeshData> data = find_cached_mesh(key)) return Mesh(data);
+
+        MeshData mesh;
+        mesh.has_normal = true;
+        mesh.has_uv = true;
 
-        mesh._vertex_normals.push_back(Vec3(0, 1, 0));
+        mesh.vertex_normals.push_back(Vec3(0, 1, 0));
 
+        // Every row knows where its vertices and faces go, so rows are filled independently
+        int row_size = resolution + 1;
+        mesh.vertices.resize(row_size * row_size);
+        mesh.uv_coordinates.resize(row_size * row_size);
+        mesh.face_indices.resize(2 * resolution * resolution);
         float delta = 1.0 / resolution;
-        int index = 0;
-        for (int i=0; i<resolution+1; i++) {
-            for (int j=0; j<resolution+1; j++) {
-                mesh._vertices.push_back(Vec3(-1 + j * 2 * delta, 0, -1 + i * 2 * delta));
-                mesh._uv_coordinates.push_back(Vec3(j * delta, 1 - i * delta, 0));
+        parallel_rows(row_size, row_size, [&](int i) {
+            for (int j=0; j<row_size; j++) {
+                int index = i * row_size + j;
+                mesh.vertices[index] = Vec3(-1 + j * 2 * delta, 0, -1 + i * 2 * delta);
+                mesh.uv_coordinates[index] = Vec3(j * delta, 1 - i * delta, 0);
                 if (i != 0 && j != 0) {
                     int a, b, c, d;
                     c = index;
@@ -108,97 +1040,130 @@ namespace proxima {
                     b = c - 1;
                     a = d - 1;
 
-                    mesh._face_indices.push_back({a, b, c, 0, 0, 0, a, b, c});
-                    mesh._face_indices.push_back({c, d, a, 0, 0, 0, c, d, a});
+                    int face = 2 * ((i - 1) * resolution + j - 1);
+                    mesh.face_indices[face] = {a, b, c, 0, 0, 0, a, b, c};
+                    mesh.face_indices[face+1] = {c, d, a, 0, 0, 0, c, d, a};
                 }
-                index++;
             }
-        }
+        });
 
-        return mesh;
+        return Mesh(cache_mesh(key, std::move(mesh)));
     }
 
     Mesh Mesh::Terrain(Texture heightmap, int resolution) {
-        Mesh mesh = Mesh::Plane(resolution);
-        mesh._has_normal = false;
-        for (int i=0; i<(int)mesh._vertices.size(); i++) {
-            mesh._vertices[i].y = 0.2 * heightmap.at_uv(mesh._uv_coordinates[i]).x;
-        }
-        return mesh;
+        // A heightmap has no stable key, so terrains are not cached
+        MeshData mesh = *Mesh::Plane(resolution)._data;
+        mesh.has_normal = false;
+        parallel_rows(resolution + 1, resolution + 1, [&](int i) {
+            for (int j=i*(resolution+1); j<(i+1)*(resolution+1); j++) {
+                mesh.vertices[j].y = 0.2 * heightmap.at_uv(mesh.uv_coordinates[j]).x;
+            }
+        });
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
     }
 
     Mesh Mesh::Plot(float (*func)(float x, float y), float range, int resolution) {
-        Mesh mesh = Mesh::Plane(resolution);
-        mesh._has_normal = false;
+        // func can read globals or the time, so it is sampled again on every call
+        MeshData mesh = *Mesh::Plane(resolution)._data;
+        mesh.has_normal = false;
         float range_rec = 1 / range;
-        for (int i=0; i<(int)mesh._vertices.size(); i++) {
-            mesh._vertices[i].y = func(range * mesh._vertices[i].x, range * mesh._vertices[i].z) * range_rec;
-        }
-        return mesh;
+        parallel_rows(resolution + 1, resolution + 1, [&](int i) {
+            for (int j=i*(resolution+1); j<(i+1)*(resolution+1); j++) {
+                mesh.vertices[j].y = func(range * mesh.vertices[j].x, range * mesh.vertices[j].z) * range_rec;
+            }
+        });
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
+    }
+
+    Mesh Mesh::Plot(std::function<void(const float *x, const float *y, float *z, int n)> func, float range, int resolution) {
+        // Not cached either, as the callable is expected to change between calls
+        MeshData mesh = *Mesh::Plane(resolution)._data;
+        mesh.has_normal = false;
+        int row_size = resolution + 1;
+        float range_rec = 1 / range;
+        parallel_rows(row_size, row_size, [&](int i) {
+            std::vector<float> xs(row_size);
+            std::vector<float> ys(row_size, range * mesh.vertices[i * row_size].z);
+            std::vector<float> zs(row_size);
+            for (int j=0; j<row_size; j++) {
+                xs[j] = range * mesh.vertices[i * row_size + j].x;
+            }
+            func(xs.data(), ys.data(), zs.data(), row_size);
+            for (int j=0; j<row_size; j++) {
+                mesh.vertices[i * row_size + j].y = zs[j] * range_rec;
+            }
+        });
+        return Mesh(std::make_shared<const MeshData>(std::move(mesh)));
     }
 
     Mesh Mesh::Cube() {
-        Mesh mesh;
-        mesh._has_normal = true;
-        mesh._has_uv = true;
+        std::string key = "cube";
+        if (std::shared_ptr<const MeshData> data = find_cached_mesh(key)) return Mesh(data);
+
+        MeshData mesh;
+        mesh.has_normal = true;
+        mesh.has_uv = true;
 
         // Create vertices
         for (int i=0; i<2; i++) {
             for (int j=0; j<2; j++) {
                 for (int k=0; k<2; k++) {
-                    mesh._vertices.push_back(Vec3(i, j, k) - Vec3(0.5, 0.5, 0.5));
+                    mesh.vertices.push_back(Vec3(i, j, k) - Vec3(0.5, 0.5, 0.5));
                 }
             }
         }
 
         // Create normals
-        mesh._vertex_normals.push_back(Vec3( 1,  0,  0)); // Right
-        mesh._vertex_normals.push_back(Vec3(-1,  0,  0)); // Left
-        mesh._vertex_normals.push_back(Vec3( 0,  1,  0)); // Top
-        mesh._vertex_normals.push_back(Vec3( 0, -1,  0)); // Bottom
-        mesh._vertex_normals.push_back(Vec3( 0,  0,  1)); // Front
-        mesh._vertex_normals.push_back(Vec3( 0,  0, -1)); // Back
+        mesh.vertex_normals.push_back(Vec3( 1,  0,  0)); // Right
+        mesh.vertex_normals.push_back(Vec3(-1,  0,  0)); // Left
+        mesh.vertex_normals.push_back(Vec3( 0,  1,  0)); // Top
+        mesh.vertex_normals.push_back(Vec3( 0, -1,  0)); // Bottom
+        mesh.vertex_normals.push_back(Vec3( 0,  0,  1)); // Front
+        mesh.vertex_normals.push_back(Vec3( 0,  0, -1)); // Back
 
         // Create UVs
         float delta_u = 1.0 / 4;
         float delta_v = 1.0 / 3;
         for (int i=0; i<4; i++) {
             for (int j=0; j<5; j++) {
-                mesh._uv_coordinates.push_back(Vec3(j * delta_u, i * delta_v, 0));
+                mesh.uv_coordinates.push_back(Vec3(j * delta_u, i * delta_v, 0));
             }
         }
 
         // Right (+x)
-        mesh._face_indices.push_back({7, 5, 4, 0, 0, 0, 12, 7, 8});
-        mesh._face_indices.push_back({4, 6, 7, 0, 0, 0, 8, 13, 12});
+        mesh.face_indices.push_back({7, 5, 4, 0, 0, 0, 12, 7, 8});
+        mesh.face_indices.push_back({4, 6, 7, 0, 0, 0, 8, 13, 12});
 
         // Left (-x)
-        mesh._face_indices.push_back({2, 0, 1, 1, 1, 1, 10, 5, 6});
-        mesh._face_indices.push_back({1, 3, 2, 1, 1, 1, 6, 11, 10});
+        mesh.face_indices.push_back({2, 0, 1, 1, 1, 1, 10, 5, 6});
+        mesh.face_indices.push_back({1, 3, 2, 1, 1, 1, 6, 11, 10});
 
         // Top (+y)
-        mesh._face_indices.push_back({2, 3, 7, 2, 2, 2, 16, 11, 12});
-        mesh._face_indices.push_back({7, 6, 2, 2, 2, 2, 12, 17, 16});
+        mesh.face_indices.push_back({2, 3, 7, 2, 2, 2, 16, 11, 12});
+        mesh.face_indices.push_back({7, 6, 2, 2, 2, 2, 12, 17, 16});
 
         // Bottom (-y)
-        mesh._face_indices.push_back({1, 0, 4, 3, 3, 3, 6, 1, 2});
-        mesh._face_indices.push_back({4, 5, 1, 3, 3, 3, 2, 7, 6});
+        mesh.face_indices.push_back({1, 0, 4, 3, 3, 3, 6, 1, 2});
+        mesh.face_indices.push_back({4, 5, 1, 3, 3, 3, 2, 7, 6});
 
         // Front (+z)
-        mesh._face_indices.push_back({3, 1, 5, 4, 4, 4, 11, 6, 7});
-        mesh._face_indices.push_back({5, 7, 3, 4, 4, 4, 7, 12, 11});
+        mesh.face_indices.push_back({3, 1, 5, 4, 4, 4, 11, 6, 7});
+        mesh.face_indices.push_back({5, 7, 3, 4, 4, 4, 7, 12, 11});
 
         // Back (-z)
-        mesh._face_indices.push_back({6, 4, 0, 5, 5, 5, 13, 8, 9});
-        mesh._face_indices.push_back({0, 2, 6, 5, 5, 5, 9, 14, 13});
+        mesh.face_indices.push_back({6, 4, 0, 5, 5, 5, 13, 8, 9});
+        mesh.face_indices.push_back({0, 2, 6, 5, 5, 5, 9, 14, 13});
 
-        return mesh;
+        return Mesh(cache_mesh(key, std::move(mesh)));
     }
 
     Mesh Mesh::Sphere(int resolution) {
-        Mesh mesh;
-        mesh._has_normal = true;
-        mesh._has_uv = true;
+        std::string key = "sphere " + std::to_string(resolution);
+        if (std::shared_ptr<const MeshData> data = find_cached_mesh(key)) return Mesh(data);
+
+        MeshData mesh;
+        mesh.has_normal = true;
+        mesh.has_uv = true;
 
         float theta = 180.0 / resolution;
         int num_v_ring = resolution * 2;
@@ -219,9 +1184,9 @@ namespace proxima {
         for (int i=0; i<num_rings; i++) {
             v = rotate(v, Vec3(0, 0, theta));
             for (int j=0; j<num_v_ring; j++) {
-                mesh._vertices.push_back(v);
-                mesh._vertex_normals.push_back(v);
-                mesh._uv_coordinates.push_back(Vec3(j * delta_u, 1 - (i + 1) * delta_v, 0));
+                mesh.vertices.push_back(v);
+                mesh.vertex_normals.push_back(v);
+                mesh.uv_coordinates.push_back(Vec3(j * delta_u, 1 - (i + 1) * delta_v, 0));
 
                 int base_index = i * num_v_ring;
                 int a, b, c, d;
@@ -238,16 +1203,16 @@ namespace proxima {
                 }
 
                 if (i == 0) {
-                    mesh._face_indices.push_back({
+                    mesh.face_indices.push_back({
                         north, b, c,
                         north, b, c,
                         uv_index_north + j, b, c_uv
                     });
                 } else {
-                    mesh._face_indices.push_back({a, b, c, a, b, c, a, b, c_uv});
-                    mesh._face_indices.push_back({c, d, a, c, d, a, c_uv, d_uv, a});
+                    mesh.face_indices.push_back({a, b, c, a, b, c, a, b, c_uv});
+                    mesh.face_indices.push_back({c, d, a, c, d, a, c_uv, d_uv, a});
                     if (i == num_rings - 1) {
-                        mesh._face_indices.push_back({
+                        mesh.face_indices.push_back({
                             south, c, b,
                             south, c, b,
                             uv_index_south + j, c_uv, b
@@ -257,26 +1222,29 @@ namespace proxima {
                 v = rotate(v, Vec3(0, theta, 0));
             }
         }
-        mesh._vertices.push_back(Vec3(0, 1, 0));
-        mesh._vertices.push_back(Vec3(0, -1, 0));
-        mesh._vertex_normals.push_back((Vec3(0, 1, 0)));
-        mesh._vertex_normals.push_back((Vec3(0, -1, 0)));
+        mesh.vertices.push_back(Vec3(0, 1, 0));
+        mesh.vertices.push_back(Vec3(0, -1, 0));
+        mesh.vertex_normals.push_back((Vec3(0, 1, 0)));
+        mesh.vertex_normals.push_back((Vec3(0, -1, 0)));
         for (int i=0; i<num_rings; i++) {
-            mesh._uv_coordinates.push_back(Vec3(1, 1 - (i + 1) * delta_v, 0));
+            mesh.uv_coordinates.push_back(Vec3(1, 1 - (i + 1) * delta_v, 0));
         }
         for (int i=0; i<num_v_ring; i++) {
-            mesh._uv_coordinates.push_back(Vec3((i + 0.5) * delta_u, 1, 0));
+            mesh.uv_coordinates.push_back(Vec3((i + 0.5) * delta_u, 1, 0));
         }
         for (int i=0; i<num_v_ring; i++) {
-            mesh._uv_coordinates.push_back(Vec3((i + 0.5) * delta_u, 0, 0));
+            mesh.uv_coordinates.push_back(Vec3((i + 0.5) * delta_u, 0, 0));
         }
-        return mesh;
+        return Mesh(cache_mesh(key, std::move(mesh)));
     }
 
     Mesh Mesh::Torus(float thickness, int resolution) {
-        Mesh mesh;
-        mesh._has_normal = true;
-        mesh._has_uv = true;
+        std::string key = "torus " + std::to_string(thickness) + " " + std::to_string(resolution);
+        if (std::shared_ptr<const MeshData> data = find_cached_mesh(key)) return Mesh(data);
+
+        MeshData mesh;
+        mesh.has_normal = true;
+        mesh.has_uv = true;
 
         int num_v_ring = resolution;
         int num_rings = resolution / thickness;
@@ -299,8 +1267,8 @@ namespace proxima {
         for (int i=0; i<num_rings; i++) {
             Vec3 eulers = Vec3(0, alpha * i, 0);
             for (int j=0; j<num_v_ring; j++) {
-                mesh._vertex_normals.push_back(rotate(circle_n[j], eulers));
-                mesh._vertices.push_back(rotate(circle_v[j], eulers));
+                mesh.vertex_normals.push_back(rotate(circle_n[j], eulers));
+                mesh.vertices.push_back(rotate(circle_v[j], eulers));
 
                 int i_next = (i + 1) % num_rings;
                 int j_next = (j + 1) % num_v_ring;
@@ -314,12 +1282,12 @@ namespace proxima {
                 int c_uv = b_uv + 1;
                 int d_uv = a_uv + 1;
 
-                mesh._face_indices.push_back({
+                mesh.face_indices.push_back({
                     a, b, c,
                     a, b, c,
                     a_uv, b_uv, c_uv
                 });
-                mesh._face_indices.push_back({
+                mesh.face_indices.push_back({
                     c, d, a,
                     c, d, a,
                     c_uv, d_uv, a_uv
@@ -329,11 +1297,11 @@ namespace proxima {
 
         for (int i=0; i<num_rings+1; i++) {
             for (int j=0; j<num_v_ring+1; j++) {
-                mesh._uv_coordinates.push_back(Vec3(i * delta_u, j * delta_v, 0));
+                mesh.uv_coordinates.push_back(Vec3(i * delta_u, j * delta_v, 0));
             }
         }
 
-        return mesh;
+        return Mesh(cache_mesh(key, std::move(mesh)));
     }
 }
 
@@ -1,4 +1,5 @@
 #include "objects.h"
+#include "bvh.h"
 #include "mesh.h"
 #include "texture.h"
 #include "vec3.h"
@@ -7,28 +8,76 @@
 #include <sstream>
 #include <string>
 #include <cstdio>
+#include <vector>
 
 namespace proxima {
     Object::Object(Mesh mesh, Texture texture, int shininess) {
         this->_mesh = mesh;
         this->texture = texture;
         this->shininess = shininess;
+        this->cull_mode = CULL_BACK;
+        this->lod_pixel_error = 1;
         this->_is_light = false;
+        this->_is_instanced = false;
+        this->_is_terrain = false;
         this->position = Vec3();
         this->euler_angles = Vec3();
         this->scale = Vec3(1, 1, 1);
     }
 
+    BoundingBox transform_box(const BoundingBox &local, Vec3 position, Vec3 euler_angles, Vec3 scale) {
+        Mat4 model_matrix =
+              Mat4::Translation(position)
+            * Mat4::RotY(deg2rad(euler_angles.y))
+            * Mat4::RotX(deg2rad(euler_angles.x))
+            * Mat4::RotZ(deg2rad(euler_angles.z));
+        BoundingBox box;
+        for (int i=0; i<8; i++) {
+            Vec3 corner(
+                i & 1 ? local.max.x : local.min.x,
+                i & 2 ? local.max.y : local.min.y,
+                i & 4 ? local.max.z : local.min.z
+            );
+            Vec3 p = model_matrix * (corner * scale);
+            box.min = (i == 0 ? p : Vec3(fmin(box.min.x, p.x), fmin(box.min.y, p.y), fmin(box.min.z, p.z)));
+            box.max = (i == 0 ? p : Vec3(fmax(box.max.x, p.x), fmax(box.max.y, p.y), fmax(box.max.z, p.z)));
+        }
+        return box;
+    }
+
+    BoundingBox Object::bounding_box() const {
+        return transform_box(this->_mesh.bounding_box(), this->position, this->euler_angles, this->scale);
+    }
+
+    InstancedObject::InstancedObject(Mesh mesh, std::vector<Texture> textures) : Object(mesh) {
+        this->_is_instanced = true;
+        this->textures = textures;
+    }
+
+    BoundingBox InstancedObject::bounding_box() const {
+        const BoundingBox &local = this->_mesh.bounding_box();
+        if (this->instances.empty()) return BoundingBox();
+
+        BoundingBox box;
+        for (int i=0; i<(int)this->instances.size(); i++) {
+            const Instance &instance = this->instances[i];
+            BoundingBox instance_box = transform_box(local, instance.position, instance.euler_angles, instance.scale);
+            box = (i == 0 ? instance_box : merge(box, instance_box));
+        }
+        return box;
+    }
+
     Camera::Camera(float fov, float near, float far) : Object() {
         this->fov = fov;
         this->near = near;
         this->far = far;
     }
 
-    PointLight::PointLight(float intensity, Vec3 color) : Object(Mesh::Cube(), Texture::Color(color)) {
+    PointLight::PointLight(float intensity, Vec3 color, float radius) : Object(Mesh::Cube(), Texture::Color(color)) {
         this->_is_light = true;
         this->color = color;
         this->intensity = intensity;
+        this->radius = radius;
         this->scale = Vec3(0.1, 0.1, 0.1);
     }
 }
@@ -0,0 +1,273 @@
+#include "page_cache.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifndef __MINGW32__
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "stb_image.h"
+
+namespace proxima {
+    const char PAGE_FILE_MAGIC[8] = {'P', 'R', 'O', 'X', 'P', 'A', 'G', 'E'};
+
+    // The file starts with this, then width, height, pages_x and pages_y of every level, then
+    // the pages level by level
+    class PageFileHeader {
+    public:
+        char magic[8];
+        // The image the pages were cut from, so an edited one is noticed
+        int64_t source_time;
+        uint64_t source_size;
+        int32_t width;
+        int32_t height;
+        int32_t channels;
+        int32_t num_levels;
+    };
+
+    bool source_stamp(std::string filename, int64_t &time, uint64_t &size) {
+        std::error_code error;
+        size = std::filesystem::file_size(filename, error);
+        if (error) return false;
+        time = std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+        return !error;
+    }
+
+    // Written to a temporary name first, so a reader never sees half a file
+    bool write_page_file(std::string image_filename, std::string page_filename, int channels) {
+        PageFileHeader header = {};
+        memcpy(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic));
+        if (!source_stamp(image_filename, header.source_time, header.source_size)) return false;
+        int width, height, depth;
+        unsigned char *image = stbi_load(image_filename.c_str(), &width, &height, &depth, channels);
+        if (!image) return false;
+        TextureData texture{width, height, channels, std::vector<uint8_t>(image, image + width * height * channels), {}, LAYOUT_LINEAR};
+        stbi_image_free(image);
+        texture.build_levels();
+
+        std::string temporary = page_filename + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        header.width = width;
+        header.height = height;
+        header.channels = channels;
+        header.num_levels = texture.levels.size();
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const TextureLevel &level : texture.levels) {
+            int32_t entry[4] = {level.width, level.height, (level.width + PAGE_SIZE - 1) / PAGE_SIZE, (level.height + PAGE_SIZE - 1) / PAGE_SIZE};
+            written = written && fwrite(entry, sizeof(int32_t), 4, file) == 4;
+        }
+
+        std::vector<uint8_t> page(PAGE_SIZE * PAGE_SIZE * channels);
+        for (const TextureLevel &level : texture.levels) {
+            const uint8_t *in = &texture.texels[level.offset];
+            for (int py=0; py<level.height && written; py+=PAGE_SIZE) {
+                for (int px=0; px<level.width && written; px+=PAGE_SIZE) {
+                    for (int y=0; y<PAGE_SIZE; y++) {
+                        int sy = std::min(py + y, level.height - 1);
+                        for (int x=0; x<PAGE_SIZE; x++) {
+                            int sx = std::min(px + x, level.width - 1);
+                            std::copy_n(&in[(sx + (size_t)sy * level.width) * channels], channels, &page[(x + y * PAGE_SIZE) * channels]);
+                        }
+                    }
+                    written = fwrite(page.data(), 1, page.size(), file) == page.size();
+                }
+            }
+        }
+        written = fclose(file) == 0 && written;
+
+        std::error_code error;
+        if (written) std::filesystem::rename(temporary, page_filename, error);
+        if (!written || error) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        return true;
+    }
+
+    bool page_file_current(std::string image_filename, std::string page_filename, int channels) {
+        int64_t source_time;
+        uint64_t source_size;
+        if (!source_stamp(image_filename, source_time, source_size)) return false;
+        FILE *file = fopen(page_filename.c_str(), "rb");
+        if (!file) return false;
+        PageFileHeader header;
+        bool read = fread(&header, sizeof(header), 1, file) == 1;
+        fclose(file);
+        return read && memcmp(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic)) == 0
+            && header.source_time == source_time && header.source_size == source_size && header.channels == channels;
+    }
+
+    std::shared_ptr<PageCache> open_page_file(std::string image_filename, std::string page_filename, int channels, int num_slots) {
+        if (!page_file_current(image_filename, page_filename, channels) && !write_page_file(image_filename, page_filename, channels))
+            return nullptr;
+        std::shared_ptr<PageCache> pages = std::make_shared<PageCache>(page_filename, num_slots);
+        if (!pages->loaded()) return nullptr;
+        return pages;
+    }
+
+    PageCache::PageCache(std::string page_filename, int num_slots, int pages_per_stream) {
+        this->pages_per_stream = pages_per_stream;
+        this->_width = 0;
+        this->_height = 0;
+        this->_channels = 0;
+        this->_page_bytes = 0;
+        this->_data_offset = 0;
+        this->_mapped = nullptr;
+        this->_mapped_size = 0;
+        this->_frame = 1;
+        this->_file = fopen(page_filename.c_str(), "rb");
+        if (!this->_file) return;
+
+        // Anything that does not add up leaves the cache without levels, which loaded() reports
+        PageFileHeader header;
+        if (fread(&header, sizeof(header), 1, this->_file) != 1) return;
+        if (memcmp(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic)) != 0) return;
+        if (header.width < 1 || header.height < 1 || (header.channels != 1 && header.channels != 4)) return;
+        if (header.num_levels < 1 || header.num_levels > 32) return;
+        std::vector<PageLevel> levels;
+        size_t num_pages = 0;
+        for (int l=0; l<header.num_levels; l++) {
+            int32_t entry[4];
+            if (fread(entry, sizeof(int32_t), 4, this->_file) != 4) return;
+            if (entry[0] < 1 || entry[1] < 1 || entry[2] != (entry[0] + PAGE_SIZE - 1) / PAGE_SIZE || entry[3] != (entry[1] + PAGE_SIZE - 1) / PAGE_SIZE)
+                return;
+            levels.push_back({entry[0], entry[1], entry[2], entry[3], (int)num_pages});
+            num_pages += (size_t)entry[2] * entry[3];
+        }
+        if (levels.back().pages_x * levels.back().pages_y != 1) return;
+        size_t page_bytes = PAGE_SIZE * PAGE_SIZE * header.channels;
+        size_t data_offset = sizeof(header) + sizeof(int32_t) * 4 * header.num_levels;
+
+        // A file cut short would have pages read past its end
+        struct stat info;
+        if (fstat(fileno(this->_file), &info) != 0 || (size_t)info.st_size < data_offset + num_pages * page_bytes) return;
+        this->_width = header.width;
+        this->_height = header.height;
+        this->_channels = header.channels;
+        this->_levels = levels;
+        this->_page_bytes = page_bytes;
+        this->_data_offset = data_offset;
+
+#ifndef __MINGW32__
+        // Mapped pages are read in by the kernel as they are first copied out
+        this->_mapped_size = info.st_size;
+        void *mapped = mmap(nullptr, this->_mapped_size, PROT_READ, MAP_PRIVATE, fileno(this->_file), 0);
+        if (mapped != MAP_FAILED) {
+            this->_mapped = (const uint8_t*)mapped;
+            fclose(this->_file);
+            this->_file = nullptr;
+        }
+#endif
+
+        // Every level from the first single page one down is kept in, so leave room for more
+        int first_pinned = 0;
+        while (this->_levels[first_pinned].pages_x * this->_levels[first_pinned].pages_y > 1) {
+            first_pinned++;
+        }
+        int num_pinned = num_pages - this->_levels[first_pinned].first_page;
+        num_slots = std::max(num_slots, num_pinned + 1);
+
+        this->_slots.resize(num_slots * this->_page_bytes);
+        this->_slot_pages.assign(num_slots, -1);
+        this->_page_slots.assign(num_pages, -1);
+        this->_pinned.assign(num_pages, false);
+        this->_wanted.reset(new std::atomic<int>[num_pages]);
+        for (size_t page=0; page<num_pages; page++) {
+            this->_wanted[page] = 0;
+        }
+        for (int i=0; i<num_pinned; i++) {
+            int page = this->_levels[first_pinned].first_page + i;
+            this->_load(page, i);
+            this->_pinned[page] = true;
+        }
+    }
+
+    PageCache::~PageCache() {
+#ifndef __MINGW32__
+        if (this->_mapped) munmap((void*)this->_mapped, this->_mapped_size);
+#endif
+        if (this->_file) fclose(this->_file);
+    }
+
+    int PageCache::num_resident() const {
+        return std::count_if(this->_slot_pages.begin(), this->_slot_pages.end(), [](int page) {
+            return page != -1;
+        });
+    }
+
+    void PageCache::_load(int page, int slot) {
+        if (this->_slot_pages[slot] != -1)
+            this->_page_slots[this->_slot_pages[slot]] = -1;
+        size_t offset = this->_data_offset + (size_t)page * this->_page_bytes;
+        uint8_t *out = &this->_slots[slot * this->_page_bytes];
+        if (this->_mapped) {
+            memcpy(out, this->_mapped + offset, this->_page_bytes);
+        } else {
+            fseek(this->_file, offset, SEEK_SET);
+            fread(out, 1, this->_page_bytes, this->_file);
+        }
+        this->_slot_pages[slot] = page;
+        this->_page_slots[page] = slot;
+    }
+
+    int PageCache::num_missing() const {
+        int frame = this->_frame;
+        int missing = 0;
+        for (size_t page=0; page<this->_page_slots.size(); page++) {
+            if (this->_page_slots[page] == -1 && this->_wanted[page] == frame)
+                missing++;
+        }
+        return missing;
+    }
+
+    int PageCache::stream() {
+        int frame = this->_frame;
+        int num_pages = this->_page_slots.size();
+
+        // Coarse pages come first, as they stand in for the most finer ones while those wait
+        std::vector<int> missing;
+        for (int page=num_pages-1; page>=0; page--) {
+            if (this->_page_slots[page] == -1 && this->_wanted[page] == frame)
+                missing.push_back(page);
+        }
+        if ((int)missing.size() > this->pages_per_stream)
+            missing.resize(this->pages_per_stream);
+
+        int loaded = 0;
+        for (int page : missing) {
+            // Free slots count as used the longest time ago
+            int victim = -1;
+            int victim_frame = frame;
+            for (int slot=0; slot<(int)this->_slot_pages.size(); slot++) {
+                int resident = this->_slot_pages[slot];
+                if (resident != -1 && this->_pinned[resident]) continue;
+                int used = resident == -1 ? -1 : this->_wanted[resident].load();
+                if (used < victim_frame) {
+                    victim = slot;
+                    victim_frame = used;
+                }
+            }
+            // Everything in was looked at this frame too, so swapping would only thrash
+            if (victim == -1) break;
+            this->_load(page, victim);
+            loaded++;
+        }
+        this->_frame = frame + 1;
+        return loaded;
+    }
+}
@@ -1,36 +1,45 @@
 #include "renderer.h"
 #include "objects.h"
 #include "scene.h"
+#include "terrain.h"
 #include "mesh.h"
 #include "texture.h"
 #include "vec3.h"
+#include "thread_pool.h"
+#include "simd.h"
 #include <cmath>
+#include <cstdint>
 #include <algorithm>
 #include <vector>
 #include <array>
-#include <set>
-#include <tuple>
 
 namespace proxima {
-    int color2rgba(Vec3 color) {
-        int r = fmin(1, color.x) * 255;
-        int g = fmin(1, color.y) * 255;
-        int b = fmin(1, color.z) * 255;
-        return (r << 24) + (g << 16) + (b << 8) + 0xff;
-    }
-
-    Renderer::Renderer(int width, int height) {
+    Renderer::Renderer(int width, int height, int num_threads) {
         this->_width = width;
         this->_height = height;
         this->_num_pixels = width * height;
         this->_aspect = (float)width / height;
         this->_frame_buffer = new int[this->_num_pixels];
-        this->_fragment_buffer = new Fragment[this->_num_pixels];
+        this->_gbuffer = new GBuffer(width, height);
+        this->_ray_fov = 0;
+        this->_ray_x.resize(width);
+        this->_ray_y.resize(height);
+        this->_thread_pool = new ThreadPool(num_threads);
+        this->_num_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        this->_num_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        this->_tile_bins.resize(this->_num_tiles_x * this->_num_tiles_y);
     }
 
     Renderer::~Renderer() {
         delete [] this->_frame_buffer;
-        delete [] this->_fragment_buffer;
+        delete this->_gbuffer;
+        delete this->_thread_pool;
+    }
+
+    void Renderer::set_num_threads(int num_threads) {
+        if (num_threads == this->num_threads()) return;
+        delete this->_thread_pool;
+        this->_thread_pool = new ThreadPool(num_threads);
     }
 
     void Renderer::_calc_matrices() {
@@ -55,275 +64,877 @@ namespace proxima {
         }});
     }
 
-    void Renderer::_init_fragment_buffer() {
-        int half_width = this->_width >> 1;
-        int half_height = this->_height >> 1;
-        float z = -half_height / tan(deg2rad(this->_scene->camera.fov / 2));
-        int index = 0;
-        for (int y=half_height; y>-half_height; y--) {
-            for (int x=-half_width; x<half_width; x++) {
-                Fragment frag;
-                frag.vision = -Vec3(x, y, z).normalized();
-                this->_fragment_buffer[index] = frag;
-                index++;
+    void Renderer::_clear_depth(int x0, int y0, int x1, int y1) {
+        GBuffer &gbuffer = *this->_gbuffer;
+        for (int y=y0; y<y1; y++) {
+            float *row = &gbuffer.depth[y * this->_width];
+            std::fill(row + x0, row + x1, 1.0f);
+        }
+        for (int by=y0/BLOCK_SIZE; by<(y1+BLOCK_SIZE-1)/BLOCK_SIZE; by++) {
+            for (int bx=x0/BLOCK_SIZE; bx<(x1+BLOCK_SIZE-1)/BLOCK_SIZE; bx++) {
+                gbuffer.block_min_depth[bx + by * gbuffer.num_blocks_x] = 1;
+                gbuffer.block_max_depth[bx + by * gbuffer.num_blocks_x] = 1;
+            }
+        }
+    }
+
+    void Renderer::_update_block_depth(int x0, int y0, int x1, int y1) {
+        GBuffer &gbuffer = *this->_gbuffer;
+        float min_depth = 1;
+        float max_depth = 0;
+        for (int y=y0; y<y1; y++) {
+            for (int x=x0; x<x1; x++) {
+                float depth = gbuffer.depth[x + y * this->_width];
+                min_depth = std::min(min_depth, depth);
+                max_depth = std::max(max_depth, depth);
             }
         }
+        int block = x0 / BLOCK_SIZE + (y0 / BLOCK_SIZE) * gbuffer.num_blocks_x;
+        gbuffer.block_min_depth[block] = min_depth;
+        gbuffer.block_max_depth[block] = max_depth;
+    }
+
+    // View-space direction through each pixel center, scaled to z = -1
+    void Renderer::_calc_view_rays() {
+        float fov = this->_scene->camera.fov;
+        if (fov == this->_ray_fov) return;
+        this->_ray_fov = fov;
+        float s = 1 / tan(deg2rad(fov / 2));
+        float half_width = this->_width >> 1;
+        float half_height = this->_height >> 1;
+        for (int x=0; x<this->_width; x++) {
+            this->_ray_x[x] = ((x + 0.5) / half_width - 1) * this->_aspect / s;
+        }
+        for (int y=0; y<this->_height; y++) {
+            this->_ray_y[y] = (1 - (y + 0.5) / half_height) / s;
+        }
     }
 
-    std::tuple<std::vector<Vertex*>, std::vector<Face>> make_primitives(const Mesh &mesh) {
-        std::vector<Vertex*> vertices;
-        std::vector<Face> faces;
-        if (mesh.has_normal()) {
-            std::map<std::array<int, 3>, Vertex*> vertex_table;
-            for (std::array<int, 9> face_index : mesh.face_indices()) {
-                std::array<Vertex*, 3> face_vertices;
-                for (int i=0; i<3; i++) {
-                    int vi = face_index[i];
-                    int ni = face_index[i+3];
-                    int ti = (mesh.has_uv() ? face_index[i+6] : 0);
-                    if (!vertex_table.contains({vi, ni, ti})) {
-                        Vec3 v = mesh.vertices()[vi];
-                        Vec3 n = mesh.vertex_normals()[ni];
-                        Vec3 t = (mesh.has_uv() ? mesh.uv_coordinates()[ti] : Vec3());
-                        vertex_table[{vi, ni, ti}] = new Vertex(v, n, t);
+    int Renderer::_depth_slice(float depth) const {
+        float n = this->_scene->camera.near;
+        float f = this->_scene->camera.far;
+        int slice = log2(depth / n) * CLUSTER_SLICES / log2(f / n);
+        return std::clamp(slice, 0, CLUSTER_SLICES - 1);
+    }
+
+    void Renderer::_build_clusters() {
+        int num_clusters = this->_num_tiles_x * this->_num_tiles_y * CLUSTER_SLICES;
+        this->_unbounded_lights.clear();
+        this->_light_first_slice.assign(this->_light_sources.size(), 0);
+        this->_cluster_offsets.assign(num_clusters + 1, 0);
+
+        // Tiles and slices a light's sphere can reach, from the corners of its bounding box
+        float n = this->_scene->camera.near;
+        float f = this->_scene->camera.far;
+        int half_width = this->_width >> 1;
+        int half_height = this->_height >> 1;
+        float scale_x = this->_projection_matrix[0][0] * half_width;
+        float scale_y = this->_projection_matrix[1][1] * half_height;
+        auto light_clusters = [&](const PointLight &light, std::array<int, 6> &range) {
+            Vec3 c = light.position;
+            float r = light.radius;
+            float z_near = fmax(-c.z - r, n);
+            float z_far = -c.z + r;
+            if (z_far < n || z_near > f) return false;
+
+            float x0 = half_width + scale_x * fmin((c.x - r) / z_near, (c.x - r) / z_far);
+            float x1 = half_width + scale_x * fmax((c.x + r) / z_near, (c.x + r) / z_far);
+            float y0 = half_height - scale_y * fmax((c.y + r) / z_near, (c.y + r) / z_far);
+            float y1 = half_height - scale_y * fmin((c.y - r) / z_near, (c.y - r) / z_far);
+            if (x1 < 0 || x0 >= this->_width || y1 < 0 || y0 >= this->_height) return false;
+
+            range[0] = std::max(0, (int)x0 / TILE_SIZE);
+            range[1] = std::max(0, (int)y0 / TILE_SIZE);
+            range[2] = std::min(this->_num_tiles_x - 1, (int)x1 / TILE_SIZE);
+            range[3] = std::min(this->_num_tiles_y - 1, (int)y1 / TILE_SIZE);
+            range[4] = this->_depth_slice(z_near);
+            range[5] = this->_depth_slice(z_far);
+            return true;
+        };
+        auto for_each_cluster = [&](const std::array<int, 6> &range, auto visit) {
+            for (int ty=range[1]; ty<=range[3]; ty++) {
+                for (int tx=range[0]; tx<=range[2]; tx++) {
+                    for (int slice=range[4]; slice<=range[5]; slice++) {
+                        visit((tx + ty * this->_num_tiles_x) * CLUSTER_SLICES + slice);
                     }
-                    face_vertices[i] = vertex_table[{vi, ni, ti}];
                 }
-                faces.push_back(Face(face_vertices));
             }
-            for (auto &entry : vertex_table) {
-                vertices.push_back(entry.second);
-            }
-        } else {
-            for (std::array<int, 9> face_index : mesh.face_indices()) {
-                std::array<Vec3, 3> vs;
-                for (int i=0; i<3; i++) {
-                    vs[i] = mesh.vertices()[face_index[i]];
-                }
-                Vec3 normal = cross(vs[1]-vs[0], vs[2]-vs[0]).normalized();
-                std::array<Vertex*, 3> vp;
-                for (int i=0; i<3; i++) {
-                    Vec3 uv = mesh.has_uv() ? mesh.uv_coordinates()[face_index[i+6]] : Vec3();
-                    vp[i] = new Vertex(vs[i], normal, uv);
-                    vertices.push_back(vp[i]);
-                }
-                faces.push_back(Face(vp));
+        };
+
+        // Count the lights per cluster, then fill the lists back to front so that each
+        // cluster ends up with its lights in order
+        std::array<int, 6> range;
+        for (int i=0; i<(int)this->_light_sources.size(); i++) {
+            const PointLight &light = this->_light_sources[i];
+            if (light.radius <= 0) {
+                this->_unbounded_lights.push_back(i);
+                continue;
             }
+            if (!light_clusters(light, range)) continue;
+            this->_light_first_slice[i] = range[4];
+            for_each_cluster(range, [&](int cluster) { this->_cluster_offsets[cluster]++; });
+        }
+        for (int i=1; i<=num_clusters; i++) {
+            this->_cluster_offsets[i] += this->_cluster_offsets[i-1];
+        }
+        this->_cluster_lights.resize(this->_cluster_offsets[num_clusters]);
+        for (int i=(int)this->_light_sources.size()-1; i>=0; i--) {
+            const PointLight &light = this->_light_sources[i];
+            if (light.radius <= 0 || !light_clusters(light, range)) continue;
+            for_each_cluster(range, [&](int cluster) {
+                this->_cluster_lights[--this->_cluster_offsets[cluster]] = i;
+            });
         }
-        return {vertices, faces};
     }
 
-    std::tuple<std::set<Vertex*>, std::vector<Face>> clip_faces(const std::vector<Face> &faces) {
-        std::vector<Face> new_faces;
-        std::set<Vertex*> new_vertices;
-        std::set<Vertex*> old_vertices;
-        for (Face face : faces) {
-            std::vector<Vertex*> face_vertices;
-            for (int i=0; i<3; i++) {
-                Vertex *a = face.vertices[i];
-                Vertex *b = face.vertices[(i+1)%3];
+    GBuffer::GBuffer(int width, int height) {
+        int num_pixels = width * height;
+        this->num_blocks_x = (width + Renderer::BLOCK_SIZE - 1) / Renderer::BLOCK_SIZE;
+        int num_blocks = this->num_blocks_x * ((height + Renderer::BLOCK_SIZE - 1) / Renderer::BLOCK_SIZE);
+        this->depth = new float[num_pixels];
+        this->block_min_depth = new float[num_blocks];
+        this->block_max_depth = new float[num_blocks];
+        this->normal = new uint32_t[num_pixels];
+        this->albedo = new uint32_t[num_pixels];
+        this->material = new uint16_t[num_pixels];
+    }
 
-                // Add a as long as it's inside
-                if (a->position.z > 0) {
-                    face_vertices.push_back(a);
-                    new_vertices.insert(a);
-                } else {
-                    old_vertices.insert(a);
-                }
+    GBuffer::~GBuffer() {
+        delete [] this->depth;
+        delete [] this->block_min_depth;
+        delete [] this->block_max_depth;
+        delete [] this->normal;
+        delete [] this->albedo;
+        delete [] this->material;
+    }
+
+    // Octahedral encoding into two 16-bit snorms; the normal needn't be unit length
+    uint32_t encode_normal(Vec3 n) {
+        float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+        float x = n.x / l1;
+        float y = n.y / l1;
+        if (n.z < 0) {
+            float folded_x = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+            float folded_y = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+            x = folded_x;
+            y = folded_y;
+        }
+        uint16_t qx = (int16_t)lround(x * 32767);
+        uint16_t qy = (int16_t)lround(y * 32767);
+        return qx | ((uint32_t)qy << 16);
+    }
 
-                // Continue if same side
-                if (a->position.z * b->position.z > 0) continue;
-
-                // Or we clip and add the new vertex
-                float t = a->position.z / (a->position.z - b->position.z);
-                Vec4 new_pos = lerp(a->position, b->position, t);
-                Vec3 new_normal = lerp(a->normal, b->normal, t).normalized();
-                Vec3 new_uv = lerp(a->uv, b->uv, t);
-                Vec3 new_view_pos = lerp(a->view_pos, b->view_pos, t);
-                Vertex *new_vertex = new Vertex(new_pos, new_normal, new_uv, new_view_pos);
-                face_vertices.push_back(new_vertex);
-                new_vertices.insert(new_vertex);
+    Vec3x8 decode_normals(Int8 packed) {
+        Float8 x = __builtin_convertvector((packed << 16) >> 16, Float8) * (1.0f / 32767);
+        Float8 y = __builtin_convertvector(packed >> 16, Float8) * (1.0f / 32767);
+        Float8 z = 1 - (x < 0.0f ? -x : x) - (y < 0.0f ? -y : y);
+        Float8 t = max(-z, splat(0));
+        x += select(x >= 0.0f, -t, t);
+        y += select(y >= 0.0f, -t, t);
+        Vec3x8 n(x, y, z);
+        return fast_rsqrt(dot(n, n)) * n;
+    }
+
+    // Snap the vertices to the subpixel grid, returning twice the signed area they span.
+    // Front faces wind counter-clockwise, which is a negative area with y pointing down.
+    int64_t snap_face(const std::array<const Vertex*, 3> &face, int64_t *px, int64_t *py) {
+        for (int i=0; i<3; i++) {
+            px[i] = llround(face[i]->position.x * Renderer::SUBPIXEL);
+            py[i] = llround(face[i]->position.y * Renderer::SUBPIXEL);
+        }
+        return (px[1] - px[0]) * (py[2] - py[0]) - (py[1] - py[0]) * (px[2] - px[0]);
+    }
+
+    // First and one past the last pixel whose center lies within a snapped coordinate range
+    int64_t first_sample(int64_t min) {
+        return (min - (Renderer::SUBPIXEL >> 1) + Renderer::SUBPIXEL - 1) >> Renderer::SUBPIXEL_BITS;
+    }
+
+    int64_t end_sample(int64_t max) {
+        return ((max - (Renderer::SUBPIXEL >> 1)) >> Renderer::SUBPIXEL_BITS) + 1;
+    }
+
+    // Signed distance to a clip plane in homogeneous clip space, positive inside
+    float plane_distance(const Vec4 &p, int plane, float extent) {
+        switch (plane) {
+        case 0: return p.z;                 // Near
+        case 1: return p.w - p.z;           // Far
+        case 2: return p.x + extent * p.w;  // Left
+        case 3: return extent * p.w - p.x;  // Right
+        case 4: return p.y + extent * p.w;  // Bottom
+        default: return extent * p.w - p.y; // Top
+        }
+    }
+
+    // Frustum outcode in the low bits, guard band outcode in the high bits
+    int clip_code(const Vec4 &p, float guard_band) {
+        int code = 0;
+        for (int plane=0; plane<Renderer::NUM_CLIP_PLANES; plane++) {
+            if (plane_distance(p, plane, 1) < 0)
+                code |= 1 << plane;
+            if (plane_distance(p, plane, guard_band) < 0)
+                code |= 1 << (plane + Renderer::NUM_CLIP_PLANES);
+        }
+        return code;
+    }
+
+    void Renderer::_calc_frustum_planes() {
+        // The clip planes are linear in clip space, so pull each one back through the
+        // projection to get a view space plane, normalized to measure distances
+        Mat4 &proj = this->_projection_matrix;
+        for (int plane=0; plane<NUM_CLIP_PLANES; plane++) {
+            Vec3 normal(
+                plane_distance(proj * Vec4(1, 0, 0, 0), plane, 1),
+                plane_distance(proj * Vec4(0, 1, 0, 0), plane, 1),
+                plane_distance(proj * Vec4(0, 0, 1, 0), plane, 1)
+            );
+            float offset = plane_distance(proj * Vec4(0, 0, 0, 1), plane, 1);
+            float length = normal.magnitude();
+            this->_frustum_planes[plane] = Vec4(
+                normal.x / length, normal.y / length, normal.z / length, offset / length);
+        }
+
+        // The view matrix is rigid, so the planes carry over to world space unnormalized
+        Mat4 &view = this->_view_matrix;
+        for (int plane=0; plane<NUM_CLIP_PLANES; plane++) {
+            const Vec4 &p = this->_frustum_planes[plane];
+            std::array<float, 4> world;
+            for (int j=0; j<4; j++) {
+                world[j] = p.x * view[0][j] + p.y * view[1][j] + p.z * view[2][j] + p.w * view[3][j];
             }
-            if (face_vertices.size() == 0) continue;
-            new_faces.push_back(Face({face_vertices[0], face_vertices[1], face_vertices[2]}));
-            if (face_vertices.size() == 4)
-                new_faces.push_back(Face({face_vertices[3], face_vertices[0], face_vertices[2]}));
+            this->_world_frustum_planes[plane] = Vec4(world[0], world[1], world[2], world[3]);
         }
+    }
 
-        for (Vertex *v : old_vertices) {
-            delete v;
+    Vertex lerp(const Vertex &a, const Vertex &b, float t) {
+        return Vertex(
+            lerp(a.position, b.position, t),
+            lerp(a.normal, b.normal, t).normalized(),
+            lerp(a.uv, b.uv, t),
+            lerp(a.view_pos, b.view_pos, t)
+        );
+    }
+
+    class ClipPolygon {
+    public:
+        std::array<Vertex, Renderer::MAX_CLIP_VERTICES> vertices;
+        int size;
+    };
+
+    void Renderer::_clip_face(Face face, int planes, std::vector<Face> &new_faces) {
+        static thread_local ClipPolygon polygons[2];
+        ClipPolygon *in = &polygons[0];
+        ClipPolygon *out = &polygons[1];
+        in->size = 3;
+        for (int i=0; i<3; i++) {
+            in->vertices[i] = this->_vertices[face.indices[i]];
+        }
+
+        // Sutherland-Hodgman against the guard band planes the face crosses
+        for (int plane=0; plane<NUM_CLIP_PLANES; plane++) {
+            if (!(planes & (1 << plane))) continue;
+            out->size = 0;
+            for (int i=0; i<in->size; i++) {
+                const Vertex &a = in->vertices[i];
+                const Vertex &b = in->vertices[(i + 1) % in->size];
+                float da = plane_distance(a.position, plane, GUARD_BAND);
+                float db = plane_distance(b.position, plane, GUARD_BAND);
+                if (da >= 0)
+                    out->vertices[out->size++] = a;
+                if ((da >= 0) != (db >= 0))
+                    out->vertices[out->size++] = lerp(a, b, da / (da - db));
+            }
+            std::swap(in, out);
+            if (in->size < 3) return;
         }
 
-        return {new_vertices, new_faces};
+        // Triangulate the convex result as a fan
+        int first = this->_vertices.size();
+        for (int i=0; i<in->size; i++) {
+            this->_vertices.push_back(in->vertices[i]);
+        }
+        for (int i=1; i<in->size-1; i++) {
+            new_faces.push_back(Face({first, first + i, first + i + 1}));
+        }
     }
 
     void Renderer::_render_object(const Object &obj, bool is_skybox) {
-        auto [vertices, faces] = make_primitives(obj.mesh());
+        if (obj.is_terrain()) {
+            this->_render_terrain((const TerrainObject&)obj);
+            return;
+        }
+        if (!obj.is_instanced()) {
+            Instance instance(obj.position, obj.euler_angles, obj.scale, 0, obj.shininess);
+            this->_render_instance(obj, instance, obj.texture, is_skybox);
+            return;
+        }
 
-        // Project the vertices to clip space
-        float x = deg2rad(obj.euler_angles.x);
-        float y = deg2rad(obj.euler_angles.y);
-        float z = deg2rad(obj.euler_angles.z);
+        // Every instance walks the same shared buffers
+        const InstancedObject &instanced = (const InstancedObject&)obj;
+        for (const Instance &instance : instanced.instances) {
+            this->_render_instance(obj, instance, instanced.textures[instance.texture], is_skybox);
+        }
+    }
+
+    bool Renderer::_in_view(const MeshBuffers &buffers, const Mat4 &modelview_matrix, Vec3 scale, bool &inside) const {
+        // Cull against the frustum with the bounding sphere, and tell whether the per-vertex
+        // clip tests can be skipped because everything stays inside the guard band
+        const BoundingSphere &sphere = buffers.bounding_sphere;
+        float max_scale = fmax(fabs(scale.x), fmax(fabs(scale.y), fabs(scale.z)));
+        Vec3 center = modelview_matrix * (sphere.center * scale);
+        float radius = sphere.radius * max_scale;
+        inside = true;
+        for (const Vec4 &plane : this->_frustum_planes) {
+            float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+            if (distance < -radius) return false;
+            inside = inside && distance >= radius;
+        }
+        if (inside) return true;
+
+        // The sphere straddles a plane, so try the tighter box before giving up
+        const BoundingBox &box = buffers.bounding_box;
+        int codes_and = FRUSTUM_MASK;
+        int codes_or = 0;
+        for (int i=0; i<8; i++) {
+            Vec3 corner(
+                i & 1 ? box.max.x : box.min.x,
+                i & 2 ? box.max.y : box.min.y,
+                i & 4 ? box.max.z : box.min.z
+            );
+            int code = clip_code(this->_projection_matrix * (modelview_matrix * (corner * scale)), GUARD_BAND);
+            codes_and &= code;
+            codes_or |= code;
+        }
+        if (codes_and) return false;
+        inside = (codes_or >> NUM_CLIP_PLANES) == 0;
+        return true;
+    }
+
+    void Renderer::_render_instance(const Object &obj, const Instance &instance, const Texture &texture, bool is_skybox) {
+        const Mesh &mesh = obj.mesh();
+        float x = deg2rad(instance.euler_angles.x);
+        float y = deg2rad(instance.euler_angles.y);
+        float z = deg2rad(instance.euler_angles.z);
         Mat4 model_rotation =
               Mat4::RotY(y)
             * Mat4::RotX(x)
             * Mat4::RotZ(z);
-        Mat4 model_matrix = Mat4::Translation(obj.position) * model_rotation;
+        Mat4 model_matrix = Mat4::Translation(instance.position) * model_rotation;
         Mat4 modelview_matrix = this->_view_matrix * model_matrix;
         Mat4 modelview_rotation = this->_view_rotation * model_rotation;
-        for (Vertex *v : vertices) {
-            v->normal = modelview_rotation * v->normal;
-            v->view_pos = modelview_matrix * (v->position * obj.scale);
-            v->position = this->_projection_matrix * v->view_pos;
+
+        bool inside;
+        if (!this->_in_view(mesh.buffers(), modelview_matrix, instance.scale, inside)) return;
+
+        // Pick the coarsest level of detail whose error stays under the threshold where the
+        // bounding sphere comes closest to the camera
+        const MeshBuffers *lod_buffers = &mesh.buffers();
+        if (!obj.lods.empty()) {
+            const BoundingSphere &sphere = mesh.bounding_sphere();
+            float max_scale = fmax(fabs(instance.scale.x), fmax(fabs(instance.scale.y), fabs(instance.scale.z)));
+            Vec3 center = modelview_matrix * (sphere.center * instance.scale);
+            float depth = fmax(-center.z - sphere.radius * max_scale, this->_scene->camera.near);
+            float pixels_per_unit = this->_projection_matrix[1][1] * (this->_height >> 1) / depth * max_scale;
+            for (const Mesh &lod : obj.lods) {
+                if (lod.error() * pixels_per_unit > obj.lod_pixel_error) break;
+                lod_buffers = &lod.buffers();
+            }
+        }
+
+        uint16_t material = std::clamp<int>(instance.shininess, 0, MATERIAL_SHININESS);
+        if (obj.is_light())
+            material |= MATERIAL_LIGHT;
+        if (is_skybox)
+            material |= MATERIAL_SKYBOX;
+        this->_render_buffers(*lod_buffers, lod_buffers->indices, modelview_matrix, modelview_rotation, instance.scale, inside, texture, material, obj.cull_mode);
+    }
+
+    void Renderer::_render_terrain(const TerrainObject &terrain) {
+        float x = deg2rad(terrain.euler_angles.x);
+        float y = deg2rad(terrain.euler_angles.y);
+        float z = deg2rad(terrain.euler_angles.z);
+        Mat4 model_rotation =
+              Mat4::RotY(y)
+            * Mat4::RotX(x)
+            * Mat4::RotZ(z);
+        Mat4 modelview_matrix = this->_view_matrix * Mat4::Translation(terrain.position) * model_rotation;
+        Mat4 modelview_rotation = this->_view_rotation * model_rotation;
+
+        // Chunks are picked in the terrain's own space, where the scale cancels out of the error
+        // over the distance as long as it is the same along every axis
+        Mat4 inverse_rotation = Mat4::RotZ(-z) * Mat4::RotX(-x) * Mat4::RotY(-y);
+        Vec3 inverse_scale(1 / terrain.scale.x, 1 / terrain.scale.y, 1 / terrain.scale.z);
+        Vec3 eye = (Vec3)(inverse_rotation * (this->_scene->camera.position - terrain.position)) * inverse_scale;
+        float pixels_per_unit = this->_projection_matrix[1][1] * (this->_height >> 1);
+        std::vector<TerrainPatch> patches;
+        terrain.select(eye, pixels_per_unit, [&](const MeshBuffers &buffers) {
+            bool inside;
+            return this->_in_view(buffers, modelview_matrix, terrain.scale, inside);
+        }, patches);
+
+        uint16_t material = std::clamp<int>(terrain.shininess, 0, MATERIAL_SHININESS);
+        for (const TerrainPatch &patch : patches) {
+            const MeshBuffers &buffers = patch.chunk->buffers;
+            bool inside;
+            this->_in_view(buffers, modelview_matrix, terrain.scale, inside);
+            this->_render_buffers(buffers, *patch.indices, modelview_matrix, modelview_rotation, terrain.scale, inside, terrain.texture, material, terrain.cull_mode);
+        }
+    }
+
+    void Renderer::_render_buffers(
+        const MeshBuffers &buffers, const std::vector<uint32_t> &indices, const Mat4 &modelview_matrix, const Mat4 &modelview_rotation,
+        Vec3 scale, bool inside, const Texture &texture, uint16_t material, CullMode cull_mode
+    ) {
+        // Project the vertices to clip space
+        int first = this->_vertices.size();
+        this->_vertices.resize(first + buffers.vertices.size());
+        this->_clip_codes.resize(buffers.vertices.size());
+        for (int i=0; i<(int)buffers.vertices.size(); i++) {
+            const BufferVertex &bv = buffers.vertices[i];
+            Vertex &v = this->_vertices[first + i];
+            v.normal = modelview_rotation * bv.normal;
+            v.uv = bv.uv;
+            v.view_pos = modelview_matrix * (bv.position * scale);
+            v.position = this->_projection_matrix * v.view_pos;
+            if (!inside)
+                this->_clip_codes[i] = clip_code(v.position, GUARD_BAND);
         }
 
-        auto [new_vertices, new_faces] = clip_faces(faces);
+        std::vector<Face> &faces = this->_clipped_faces;
+        faces.clear();
+        for (int i=0; i<(int)indices.size(); i+=3) {
+            Face face({
+                first + (int)indices[i],
+                first + (int)indices[i+1],
+                first + (int)indices[i+2]
+            });
+            if (inside) {
+                faces.push_back(face);
+                continue;
+            }
+            int ca = this->_clip_codes[indices[i]];
+            int cb = this->_clip_codes[indices[i+1]];
+            int cc = this->_clip_codes[indices[i+2]];
+
+            // Reject faces entirely outside one frustum plane, and only clip
+            // the ones that leave the guard band
+            if (ca & cb & cc & FRUSTUM_MASK) continue;
+            int planes = (ca | cb | cc) >> NUM_CLIP_PLANES;
+            if (planes == 0)
+                faces.push_back(face);
+            else
+                this->_clip_face(face, planes, faces);
+        }
 
         // Transform to screen space
-        for (Vertex *v : new_vertices) {
-            Vec3 ndc_space = v->position; // Perspective divide
-            int half_width = this->_width >> 1;
-            int half_height = this->_height >> 1;
-            int screen_x = (ndc_space.x + 1) * half_width;
-            int screen_y = (-ndc_space.y + 1) * half_height;
-            v->position = Vec4(screen_x, screen_y, ndc_space.z, 1 / v->position.w);
+        int half_width = this->_width >> 1;
+        int half_height = this->_height >> 1;
+        for (int i=first; i<(int)this->_vertices.size(); i++) {
+            Vertex &v = this->_vertices[i];
+            Vec3 ndc_space = v.position; // Perspective divide
+            float screen_x = (ndc_space.x + 1) * half_width;
+            float screen_y = (-ndc_space.y + 1) * half_height;
+            v.position = Vec4(screen_x, screen_y, ndc_space.z, 1 / v.position.w);
         }
 
-        // Create the fragments
-        for (Face face : new_faces) {
-            this->_rasterize(face, obj.texture, is_skybox, obj.is_light(), obj.shininess);
+        // Queue the faces up for rasterization, which happens once all objects are projected
+        for (Face face : faces) {
+            std::array<const Vertex*, 3> vs;
+            for (int i=0; i<3; i++) {
+                vs[i] = &this->_vertices[face.indices[i]];
+            }
+
+            // Cull by winding, and drop faces too thin or small to cover a pixel center
+            int64_t px[3], py[3];
+            int64_t area = snap_face(vs, px, py);
+            if (area == 0) continue;
+            if (cull_mode == CULL_BACK && area > 0) continue;
+            if (cull_mode == CULL_FRONT && area < 0) continue;
+            if (first_sample(std::min({px[0], px[1], px[2]})) >= end_sample(std::max({px[0], px[1], px[2]}))) continue;
+            if (first_sample(std::min({py[0], py[1], py[2]})) >= end_sample(std::max({py[0], py[1], py[2]}))) continue;
+
+            this->_primitives.push_back(Primitive(face, &texture, material));
         }
+    }
+
+    void Renderer::_bin_primitives() {
+        for (std::vector<int> &bin : this->_tile_bins) {
+            bin.clear();
+        }
+        for (int i=0; i<(int)this->_primitives.size(); i++) {
+            const Face &face = this->_primitives[i].face;
+            Vec4 a = this->_vertices[face.indices[0]].position;
+            Vec4 b = this->_vertices[face.indices[1]].position;
+            Vec4 c = this->_vertices[face.indices[2]].position;
+            float xmin = fmin(a.x, fmin(b.x, c.x));
+            float ymin = fmin(a.y, fmin(b.y, c.y));
+            float xmax = fmax(a.x, fmax(b.x, c.x));
+            float ymax = fmax(a.y, fmax(b.y, c.y));
+            if (xmax <= 0 || ymax <= 0 || xmin >= this->_width || ymin >= this->_height) continue;
+
+            // Primitives are appended in submission order, so every bin stays sorted
+            int tx0 = fmax(0, xmin) / TILE_SIZE;
+            int ty0 = fmax(0, ymin) / TILE_SIZE;
+            int tx1 = fmin(this->_width - 1, xmax) / TILE_SIZE;
+            int ty1 = fmin(this->_height - 1, ymax) / TILE_SIZE;
+            for (int ty=ty0; ty<=ty1; ty++) {
+                for (int tx=tx0; tx<=tx1; tx++) {
+                    this->_tile_bins[tx + ty * this->_num_tiles_x].push_back(i);
+                }
+            }
+        }
+    }
 
-        // Clean up
-        for (Vertex *v : new_vertices) {
-            delete v;
+    void Renderer::_render_tile(int tile) {
+        int x0 = (tile % this->_num_tiles_x) * TILE_SIZE;
+        int y0 = (tile / this->_num_tiles_x) * TILE_SIZE;
+        int x1 = fmin(this->_width, x0 + TILE_SIZE);
+        int y1 = fmin(this->_height, y0 + TILE_SIZE);
+        this->_clear_depth(x0, y0, x1, y1);
+        for (int i : this->_tile_bins[tile]) {
+            this->_rasterize(this->_primitives[i], x0, y0, x1, y1);
         }
+        this->_shade_pixels(x0, y0, x1, y1);
     }
 
-    void update_frag(Fragment &frag, Vec3 w, Vec3 wp, const Face &face, const Texture &texture, bool is_skybox, bool is_light, float shininess) {
-        Vertex *va = face.vertices[0];
-        Vertex *vb = face.vertices[1];
-        Vertex *vc = face.vertices[2];
+    void update_frag(GBuffer &gbuffer, int index, float depth, Vec3 wp, float lod, const std::array<const Vertex*, 3> &face, const Texture &texture, uint16_t material) {
+        const Vertex *va = face[0];
+        const Vertex *vb = face[1];
+        const Vertex *vc = face[2];
+
+        if (material & MATERIAL_SKYBOX) {
+            Vec3 uv = wp.x * va->uv + wp.y * vb->uv + wp.z * vc->uv;
+            gbuffer.albedo[index] = texture.sample(uv, lod) | 0xff;
+            gbuffer.material[index] = material;
+            return;
+        }
+
+        Vec3 normal =
+              wp.x * va->normal
+            + wp.y * vb->normal
+            + wp.z * vc->normal;
 
         Vec3 uv =
               wp.x * va->uv
             + wp.y * vb->uv
             + wp.z * vc->uv;
 
-        if (is_skybox) {
-            frag.is_skybox = true;
-            frag.color = texture.at_uv(uv);
-            return;
+        // Texels go into the G-buffer as they are stored, made opaque since nothing blends
+        gbuffer.depth[index] = depth;
+        gbuffer.normal[index] = encode_normal(normal);
+        gbuffer.albedo[index] = texture.sample(uv, lod) | 0xff;
+        gbuffer.material[index] = material;
+    }
+
+    // An attribute that varies linearly in screen space, f(x, y) = a*x + b*y + c
+    class Plane {
+    public:
+        float a, b, c;
+        Plane(float f0, float f1, float f2, const float *x, const float *y, float area) {
+            this->a = ((f1 - f0) * (y[2] - y[0]) - (f2 - f0) * (y[1] - y[0])) / area;
+            this->b = ((f2 - f0) * (x[1] - x[0]) - (f1 - f0) * (x[2] - x[0])) / area;
+            this->c = f0 - this->a * x[0] - this->b * y[0];
+        }
+        float at(float x, float y) const { return this->a * x + this->b * y + this->c; }
+    };
+
+    void Renderer::_rasterize(const Primitive &prim, int x0, int y0, int x1, int y1) {
+        const int S = SUBPIXEL;
+        const int B = BLOCK_SIZE;
+        GBuffer &gbuffer = *this->_gbuffer;
+        bool is_skybox = prim.material & MATERIAL_SKYBOX;
+        std::array<const Vertex*, 3> face;
+        for (int i=0; i<3; i++) {
+            face[i] = &this->_vertices[prim.face.indices[i]];
         }
 
-        float depth =
-              w.x * va->position.z
-            + w.y * vb->position.z
-            + w.z * vc->position.z;
-        if (depth > frag.depth) return;
+        int64_t px[3], py[3];
+        int64_t area = snap_face(face, px, py);
+        if (area == 0) return;
 
-        Vec3 normal = (
-              wp.x * va->normal
-            + wp.y * vb->normal
-            + wp.z * vc->normal
-        ).normalized();
-        if (dot(normal, frag.vision) < 0) return;
-
-        frag.depth = depth;
-        frag.normal = normal;
-        frag.is_skybox = false;
-        frag.is_light = is_light;
-        frag.shininess = shininess;
-        frag.view_pos =
-              wp.x * va->view_pos
-            + wp.y * vb->view_pos
-            + wp.z * vc->view_pos;
-        frag.color = texture.at_uv(uv);
-    }
-
-    void Renderer::_rasterize(Face face, const Texture &texture, bool is_skybox, bool is_light, float shininess) {
-        // Sort the vertices by y-value
-        if (face.vertices[0]->position.y > face.vertices[1]->position.y)
-            std::swap(face.vertices[0], face.vertices[1]);
-        if (face.vertices[0]->position.y > face.vertices[2]->position.y)
-            std::swap(face.vertices[0], face.vertices[2]);
-        if (face.vertices[1]->position.y > face.vertices[2]->position.y)
-            std::swap(face.vertices[1], face.vertices[2]);
-
-        Vec4 a = face.vertices[0]->position;
-        Vec4 b = face.vertices[1]->position;
-        Vec4 c = face.vertices[2]->position;
-
-        for (int y=fmax(0, a.y); y<fmin(this->_height, c.y); y++) {
-            float tac = (float)(y - a.y) / (c.y - a.y);
-            Vec3 wac = lerp(Vec3(1, 0, 0), Vec3(0, 0, 1), tac);
-            Vec3 wb;
-            int xac = std::lerp(a.x, c.x, tac);
-            int xb;
-            if (y < b.y) {
-                float tab = (float)(y - a.y) / (b.y - a.y);
-                wb = lerp(Vec3(1, 0, 0), Vec3(0, 1, 0), tab);
-                xb = std::lerp(a.x, b.x, tab);
-            } else {
-                float tbc = (float)(y - b.y) / (c.y - b.y);
-                wb = lerp(Vec3(0, 1, 0), Vec3(0, 0, 1), tbc);
-                xb = std::lerp(b.x, c.x, tbc);
-            }
-            int xmin = fmin(xac, xb);
-            int xmax = fmax(xac, xb);
-            int base_index = y * this->_width;
-            for (int x=fmax(0, xmin); x<fmin(this->_width, xmax); x++) {
-                float tx = (float)(x - xac) / (xb - xac);
-
-                // Barycentric coordinate
-                Vec3 w = lerp(wac, wb, tx);
-
-                // Perspective-correct barycentric coordinate
-                Vec3 wp = w * Vec3(a.w, b.w, c.w);
-                wp /= dot(wp, Vec3(1, 1, 1));
-
-                update_frag(
-                    this->_fragment_buffer[x + base_index],
-                    w, wp, face, texture,
-                    is_skybox, is_light, shininess
-                );
+        // Make the winding consistent so that the inside of every edge is positive
+        if (area < 0) {
+            std::swap(face[1], face[2]);
+            std::swap(px[1], px[2]);
+            std::swap(py[1], py[2]);
+            area = -area;
+        }
+
+        // Bounding box of the covered pixel centers, clipped to the target rect
+        int64_t half = S >> 1;
+        int xmin = std::max<int64_t>(x0, first_sample(std::min({px[0], px[1], px[2]})));
+        int ymin = std::max<int64_t>(y0, first_sample(std::min({py[0], py[1], py[2]})));
+        int xmax = std::min<int64_t>(x1, end_sample(std::max({px[0], px[1], px[2]})));
+        int ymax = std::min<int64_t>(y1, end_sample(std::max({py[0], py[1], py[2]})));
+        if (xmin >= xmax || ymin >= ymax) return;
+
+        // Edge k is the one facing vertex k, evaluated at the center of pixel (0, 0)
+        int64_t edge[3], step_x[3], step_y[3];
+        for (int k=0; k<3; k++) {
+            int i = (k + 1) % 3;
+            int j = (k + 2) % 3;
+            int64_t dx = px[j] - px[i];
+            int64_t dy = py[j] - py[i];
+            bool top_left = dy < 0 || (dy == 0 && dx > 0);
+            step_x[k] = -dy * S;
+            step_y[k] = dx * S;
+            edge[k] = dx * (half - py[i]) - dy * (half - px[i]) - (top_left ? 0 : 1);
+        }
+
+        // Set up the interpolants: depth, and the perspective-correct barycentric weights
+        float x[3], y[3], w[3], z[3];
+        for (int i=0; i<3; i++) {
+            x[i] = (float)px[i] / S;
+            y[i] = (float)py[i] / S;
+            z[i] = face[i]->position.z;
+            w[i] = face[i]->position.w;
+        }
+        float area_f = (float)area / ((int64_t)S * S);
+        Plane depth(z[0], z[1], z[2], x, y, area_f);
+        Plane w1(0, w[1], 0, x, y, area_f);
+        Plane w2(0, 0, w[2], x, y, area_f);
+        Plane w_sum(w[0], w[1], w[2], x, y, area_f);
+
+        // Texture coordinates over w, counted in base level texels, for the level of detail
+        const Texture &texture = *prim.texture;
+        bool has_levels = texture.num_levels() > 1 && texture.sample_mode != SAMPLE_NEAREST;
+        float u[3], v[3];
+        for (int i=0; i<3; i++) {
+            u[i] = face[i]->uv.x * w[i] * texture.width();
+            v[i] = face[i]->uv.y * w[i] * texture.height();
+        }
+        Plane u_over_w(u[0], u[1], u[2], x, y, area_f);
+        Plane v_over_w(v[0], v[1], v[2], x, y, area_f);
+
+        // One level of detail per 2x2 quad, from the derivatives of the texture coordinates
+        // at its center, so that every pixel in it sees the same footprint
+        auto quad_lod = [&](int qx, int qy) {
+            float cx = qx + 1.0f;
+            float cy = qy + 1.0f;
+            float inv = 1 / w_sum.at(cx, cy);
+            float qu = u_over_w.at(cx, cy) * inv;
+            float qv = v_over_w.at(cx, cy) * inv;
+            float du_dx = (u_over_w.a - qu * w_sum.a) * inv;
+            float dv_dx = (v_over_w.a - qv * w_sum.a) * inv;
+            float du_dy = (u_over_w.b - qu * w_sum.b) * inv;
+            float dv_dy = (v_over_w.b - qv * w_sum.b) * inv;
+            float rho2 = std::max(du_dx * du_dx + dv_dx * dv_dx, du_dy * du_dy + dv_dy * dv_dy);
+            return 0.5f * log2(std::max(rho2, 1.0f));
+        };
+        std::array<float, (B / 2) * (B / 2)> lods;
+
+        for (int by=ymin & ~(B-1); by<ymax; by+=B) {
+            for (int bx=xmin & ~(B-1); bx<xmax; bx+=B) {
+                int bx0 = std::max(bx, xmin);
+                int by0 = std::max(by, ymin);
+                int bx1 = std::min(bx + B, xmax);
+                int by1 = std::min(by + B, ymax);
+
+                // Classify the block against every edge using its corner pixels
+                int64_t e[3];
+                bool outside = false;
+                bool inside = true;
+                for (int k=0; k<3; k++) {
+                    e[k] = edge[k] + bx0 * step_x[k] + by0 * step_y[k];
+                    int64_t dx = step_x[k] * (bx1 - bx0 - 1);
+                    int64_t dy = step_y[k] * (by1 - by0 - 1);
+                    int64_t lo = e[k] + std::min<int64_t>(0, dx) + std::min<int64_t>(0, dy);
+                    int64_t hi = e[k] + std::max<int64_t>(0, dx) + std::max<int64_t>(0, dy);
+                    outside |= hi < 0;
+                    inside &= lo >= 0;
+                }
+                if (outside) continue;
+
+                float fx = bx0 + 0.5;
+                float fy = by0 + 0.5;
+                float d_row = depth.at(fx, fy);
+
+                // Compare the face's depth range over the block with what is already there
+                int block = (bx / B) + (by / B) * gbuffer.num_blocks_x;
+                float d_dx = depth.a * (bx1 - bx0 - 1);
+                float d_dy = depth.b * (by1 - by0 - 1);
+                float d_min = d_row + std::min(0.0f, d_dx) + std::min(0.0f, d_dy);
+                float d_max = d_row + std::max(0.0f, d_dx) + std::max(0.0f, d_dy);
+                bool pass_all = is_skybox || d_max <= gbuffer.block_min_depth[block];
+                if (!pass_all && d_min > gbuffer.block_max_depth[block]) continue;
+
+                // Quads only work out their level of detail once a pixel in them is written
+                uint32_t quads_done = 0;
+
+                float w1_row = w1.at(fx, fy);
+                float w2_row = w2.at(fx, fy);
+                float ws_row = w_sum.at(fx, fy);
+                bool written = false;
+                for (int py=by0; py<by1; py++) {
+                    int64_t e0 = e[0], e1 = e[1], e2 = e[2];
+                    float d = d_row, pw1 = w1_row, pw2 = w2_row, pws = ws_row;
+                    int index = bx0 + py * this->_width;
+                    for (int px=bx0; px<bx1; px++) {
+                        if ((inside || (e0 | e1 | e2) >= 0) && (pass_all || d <= gbuffer.depth[index])) {
+                            float inv = 1 / pws;
+                            float wb = pw1 * inv;
+                            float wc = pw2 * inv;
+                            int quad = ((px - bx) >> 1) + ((py - by) >> 1) * (B / 2);
+                            if (has_levels && !(quads_done & (1 << quad))) {
+                                lods[quad] = quad_lod(px & ~1, py & ~1);
+                                quads_done |= 1 << quad;
+                            }
+                            float lod = has_levels ? lods[quad] : 0;
+                            update_frag(
+                                gbuffer, index, d, Vec3(1 - wb - wc, wb, wc), lod,
+                                face, texture, prim.material
+                            );
+                            written = true;
+                        }
+                        e0 += step_x[0];
+                        e1 += step_x[1];
+                        e2 += step_x[2];
+                        d += depth.a;
+                        pw1 += w1.a;
+                        pw2 += w2.a;
+                        pws += w_sum.a;
+                        index++;
+                    }
+                    e[0] += step_y[0];
+                    e[1] += step_y[1];
+                    e[2] += step_y[2];
+                    d_row += depth.b;
+                    w1_row += w1.b;
+                    w2_row += w2.b;
+                    ws_row += w_sum.b;
+                }
+
+                // Keep the block's depth range up to date
+                if (!written || is_skybox) continue;
+                int block_x1 = std::min(bx + B, this->_width);
+                int block_y1 = std::min(by + B, this->_height);
+                bool whole_block = bx0 == bx && by0 == by && bx1 == block_x1 && by1 == block_y1;
+                if (whole_block && inside && pass_all) {
+                    gbuffer.block_min_depth[block] = d_min;
+                    gbuffer.block_max_depth[block] = d_max;
+                } else {
+                    this->_update_block_depth(bx, by, block_x1, block_y1);
+                }
             }
         }
     }
 
-    Vec3 Renderer::_shade(const Fragment &frag) {
-        if (frag.is_skybox || frag.is_light) return frag.color;
+    void Renderer::_shade(int x, int y, int count) {
+        GBuffer &gbuffer = *this->_gbuffer;
+        int index = x + y * this->_width;
+
+        // Load the G-buffer planes into lanes
+        Float8 depth = splat(1);
+        Float8 ray_x = {};
+        Int8 packed_normal = {};
+        Int8 albedo = {};
+        Int8 material = {};
+        for (int i=0; i<count; i++) {
+            depth[i] = gbuffer.depth[index + i];
+            ray_x[i] = this->_ray_x[x + i];
+            packed_normal[i] = gbuffer.normal[index + i];
+            albedo[i] = gbuffer.albedo[index + i];
+            material[i] = gbuffer.material[index + i];
+        }
+        Vec3x8 color(
+            __builtin_convertvector((albedo >> 24) & 0xff, Float8) * (1.0f / 255),
+            __builtin_convertvector((albedo >> 16) & 0xff, Float8) * (1.0f / 255),
+            __builtin_convertvector((albedo >> 8) & 0xff, Float8) * (1.0f / 255)
+        );
+        Int8 unlit = (material & (MATERIAL_SKYBOX | MATERIAL_LIGHT)) != 0;
+        Float8 shininess = max(__builtin_convertvector(material & MATERIAL_SHININESS, Float8), splat(1));
+        Vec3x8 normal = decode_normals(packed_normal);
+
+        // Rebuild the view-space position from depth along the pixel's view ray
+        float n = this->_scene->camera.near;
+        float f = this->_scene->camera.far;
+        Float8 linear_depth = f * n / (f - depth * (f - n));
+        Vec3x8 ray(ray_x, splat(this->_ray_y[y]), splat(-1));
+        Vec3x8 view_pos = linear_depth * ray;
+        Vec3x8 vision = (-fast_rsqrt(dot(ray, ray))) * ray;
 
         // Ambient reflection
-        Vec3 ambient = this->_scene->ambient_light * Vec3(1, 1, 1);
-        Vec3 diffuse = Vec3(0, 0, 0);
-        Vec3 specular = Vec3(0, 0, 0);
-
-        for (PointLight &light_source : this->_light_sources) {
-            Vec3 frag_to_light = light_source.position - frag.view_pos;
-            Vec3 light = frag_to_light.normalized();
-            float distance = frag_to_light.magnitude();
-            float intensity = light_source.intensity;
-            Vec3 light_color = light_source.color * intensity / pow(distance, 2);
+        Vec3x8 ambient = Vec3(1, 1, 1) * this->_scene->ambient_light;
+        Vec3x8 diffuse;
+        Vec3x8 specular;
+        Float8 specular_scale = 1 - 1 / shininess;
+
+        auto add_light = [&](const PointLight &light_source) {
+            Vec3x8 frag_to_light = Vec3x8(light_source.position) - view_pos;
+            Float8 distance2 = dot(frag_to_light, frag_to_light);
+            Vec3x8 light = fast_rsqrt(distance2) * frag_to_light;
+            Vec3x8 light_color = (light_source.intensity / distance2) * Vec3x8(light_source.color);
+            if (light_source.radius > 0) {
+                // Fade smoothly to nothing at the radius
+                float radius2 = light_source.radius * light_source.radius;
+                Float8 falloff = max(1 - distance2 * distance2 / (radius2 * radius2), splat(0));
+                light_color = (falloff * falloff) * light_color;
+            }
 
             // Diffuse reflection
-            float ln = dot(light, frag.normal);
-            if (ln < 0) continue;
-            diffuse += ln * light_color;
+            Float8 ln = dot(light, normal);
+            Int8 facing = ln >= 0.0f;
+            diffuse = diffuse + select(facing, ln * light_color, Vec3x8());
 
             // Specular reflection
-            Vec3 reflection = 2 * ln * frag.normal - light;
-            float rv = dot(reflection, frag.vision);
-            specular += pow(fmax(0, rv), frag.shininess) * (-1.0 / frag.shininess + 1) * light_color;
+            Vec3x8 reflection = (2 * ln) * normal - light;
+            Float8 rv = max(dot(reflection, vision), splat(0));
+            Float8 highlight = fast_pow(rv, shininess) * specular_scale;
+            specular = specular + select(facing, highlight * light_color, Vec3x8());
+        };
+
+        for (int i : this->_unbounded_lights) {
+            add_light(this->_light_sources[i]);
+        }
+
+        // Bounded lights come from the clusters spanning the depths of the lit lanes
+        float z_min = f;
+        float z_max = n;
+        for (int i=0; i<count; i++) {
+            if (unlit[i]) continue;
+            z_min = fmin(z_min, linear_depth[i]);
+            z_max = fmax(z_max, linear_depth[i]);
         }
+        if (z_min <= z_max) {
+            int tile = x / TILE_SIZE + (y / TILE_SIZE) * this->_num_tiles_x;
+            int first = this->_depth_slice(z_min);
+            int last = this->_depth_slice(z_max);
+            for (int slice=first; slice<=last; slice++) {
+                int cluster = tile * CLUSTER_SLICES + slice;
+                for (int k=this->_cluster_offsets[cluster]; k<this->_cluster_offsets[cluster+1]; k++) {
+                    // Lights spanning several slices are only added in the first one here
+                    int i = this->_cluster_lights[k];
+                    if (slice == first || this->_light_first_slice[i] == slice)
+                        add_light(this->_light_sources[i]);
+                }
+            }
+        }
+
+        Vec3x8 result = (ambient + diffuse + specular) * color;
+
+        // Pack into RGBA, letting unlit pixels through as they are
+        Int8 r = __builtin_convertvector(min(result.x, splat(1)) * 255, Int8);
+        Int8 g = __builtin_convertvector(min(result.y, splat(1)) * 255, Int8);
+        Int8 b = __builtin_convertvector(min(result.z, splat(1)) * 255, Int8);
+        Int8 rgba = unlit ? albedo : (r << 24) + (g << 16) + (b << 8) + 0xff;
+        for (int i=0; i<count; i++) {
+            this->_frame_buffer[index + i] = rgba[i];
+        }
+    }
 
-        return (ambient + diffuse + specular) * frag.color;
+    void Renderer::_shade_pixels(int x0, int y0, int x1, int y1) {
+        for (int y=y0; y<y1; y++) {
+            for (int x=x0; x<x1; x+=LANES) {
+                this->_shade(x, y, std::min(LANES, x1 - x));
+            }
+        }
     }
 
     int *Renderer::render(const Scene &scene) {
         this->_scene = &scene;
-        this->_init_fragment_buffer();
         this->_calc_matrices();
+        this->_calc_frustum_planes();
+        this->_calc_view_rays();
 
         // Sort out the light sources
         this->_light_sources.clear();
@@ -334,19 +945,50 @@ namespace proxima {
             light_source.position = this->_view_matrix * light_source.position;
             this->_light_sources.push_back(light_source);
         }
+        this->_build_clusters();
 
         // Create and render the skybox
         Object skybox(Mesh::Cube(), scene.skybox);
         skybox.position = scene.camera.position;
         skybox.scale = Vec3(1, 1, 1) * scene.camera.far;
+        skybox.cull_mode = CULL_FRONT;
         this->_render_object(skybox, true);
 
-        for (auto &obj_entry : scene.objects()) {
-            this->_render_object(*obj_entry.second, false);
+        // Only objects the scene hierarchy can't rule out are projected
+        scene.query_frustum(this->_world_frustum_planes, [this](Object *obj) {
+            this->_render_object(*obj, false);
+        });
+
+        if (this->num_threads() == 1) {
+            this->_clear_depth(0, 0, this->_width, this->_height);
+            for (const Primitive &prim : this->_primitives) {
+                this->_rasterize(prim, 0, 0, this->_width, this->_height);
+            }
+            this->_shade_pixels(0, 0, this->_width, this->_height);
+        } else {
+            // Tiles own disjoint pixels, so workers need no locking
+            this->_bin_primitives();
+            this->_thread_pool->run(this->_tile_bins.size(), [this](int tile) {
+                this->_render_tile(tile);
+            });
         }
-        for (int i=0; i<this->_num_pixels; i++) {
-            this->_frame_buffer[i] = color2rgba(this->_shade(this->_fragment_buffer[i]));
+
+        // Pages of virtual textures sampled this frame come in for the next one
+        scene.skybox.stream();
+        for (auto &obj_entry : scene.objects()) {
+            Object *obj = obj_entry.second;
+            if (obj->is_instanced()) {
+                for (const Texture &texture : ((InstancedObject*)obj)->textures) {
+                    texture.stream();
+                }
+            } else {
+                obj->texture.stream();
+            }
         }
+
+        // Keep the capacity around for the next frame
+        this->_vertices.clear();
+        this->_primitives.clear();
         return this->_frame_buffer;
     }
 }
@@ -1,6 +1,15 @@
 #include "scene.h"
+#include "bvh.h"
+#include "mesh.h"
 #include "objects.h"
 #include "texture.h"
+#include "vec3.h"
+
+#include <array>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace proxima {
     Scene::Scene(Texture skybox, float ambient_light) {
@@ -15,7 +24,129 @@ namespace proxima {
     }
 
     Object *&Scene::operator[](std::string obj_name) {
+        // The caller may add, replace or move the object through the reference
+        this->_touched.insert(obj_name);
         return this->_objects[obj_name];
     }
-}
 
+    void Scene::_update_bvh() const {
+        if (this->_touched.empty()) return;
+
+        // New or replaced objects change the shape of the tree, the rest have at most moved
+        bool rebuild = false;
+        for (const std::string &name : this->_touched) {
+            auto obj = this->_objects.find(name);
+            if (obj == this->_objects.end()) continue;
+            auto item = this->_bvh_items.find(name);
+            if (item == this->_bvh_items.end()
+                ? obj->second != nullptr
+                : this->_bvh_objects[item->second] != obj->second) {
+                rebuild = true;
+                break;
+            }
+        }
+
+        if (rebuild) {
+            std::vector<BoundingBox> boxes;
+            this->_bvh_names.clear();
+            this->_bvh_objects.clear();
+            this->_bvh_items.clear();
+            for (auto &entry : this->_objects) {
+                if (entry.second == nullptr) continue;
+                this->_bvh_items[entry.first] = this->_bvh_names.size();
+                this->_bvh_names.push_back(entry.first);
+                this->_bvh_objects.push_back(entry.second);
+                boxes.push_back(entry.second->bounding_box());
+            }
+            this->_bvh.build(boxes);
+        } else {
+            for (const std::string &name : this->_touched) {
+                auto item = this->_bvh_items.find(name);
+                if (item == this->_bvh_items.end()) continue;
+                this->_bvh.refit(item->second, this->_bvh_objects[item->second]->bounding_box());
+            }
+        }
+        this->_touched.clear();
+    }
+
+    void Scene::query_frustum(const std::array<Vec4, 6> &planes, std::function<void(Object*)> visit) const {
+        this->_update_bvh();
+        this->_bvh.query_frustum(planes, [&](int item) {
+            visit(this->_bvh_objects[item]);
+        });
+    }
+
+    // Closest hit on an instance of the mesh nearer than closest, found in the mesh's own
+    // space where the ray keeps its parametrization
+    bool intersect(const MeshBuffers &buffers, const Instance &instance, Vec3 origin, Vec3 direction, float &closest, Vec3 &normal) {
+        float x = deg2rad(instance.euler_angles.x);
+        float y = deg2rad(instance.euler_angles.y);
+        float z = deg2rad(instance.euler_angles.z);
+        Mat4 inverse_rotation = Mat4::RotZ(-z) * Mat4::RotX(-x) * Mat4::RotY(-y);
+        Vec3 inverse_scale(1 / instance.scale.x, 1 / instance.scale.y, 1 / instance.scale.z);
+        Vec3 o = (Vec3)(inverse_rotation * (origin - instance.position)) * inverse_scale;
+        Vec3 d = (Vec3)(inverse_rotation * direction) * inverse_scale;
+
+        bool found = false;
+        for (int i=0; i<(int)buffers.indices.size(); i+=3) {
+            Vec3 a = buffers.vertices[buffers.indices[i]].position;
+            Vec3 e1 = buffers.vertices[buffers.indices[i+1]].position - a;
+            Vec3 e2 = buffers.vertices[buffers.indices[i+2]].position - a;
+            Vec3 p = cross(d, e2);
+            float det = dot(e1, p);
+            if (fabs(det) < 1e-12f) continue;
+            Vec3 s = o - a;
+            float u = dot(s, p) / det;
+            if (u < 0 || u > 1) continue;
+            Vec3 q = cross(s, e1);
+            float v = dot(d, q) / det;
+            if (v < 0 || u + v > 1) continue;
+            float t = dot(e2, q) / det;
+            if (t < 0 || t >= closest) continue;
+            closest = t;
+            normal = cross(e1, e2);
+            found = true;
+        }
+        if (!found) return false;
+
+        // Normals take the inverse transpose, which for rotation and scale is the inverse scale
+        Mat4 rotation = Mat4::RotY(y) * Mat4::RotX(x) * Mat4::RotZ(z);
+        normal = Vec3(rotation * (normal * inverse_scale)).normalized();
+        if (dot(normal, direction) > 0)
+            normal = -normal;
+        return true;
+    }
+
+    bool Scene::raycast(Vec3 origin, Vec3 direction, RayHit &hit, float max_distance) const {
+        this->_update_bvh();
+        direction = direction.normalized();
+        bool found = false;
+        this->_bvh.query_ray(origin, direction, max_distance, [&](int item, float closest) {
+            const Object &obj = *this->_bvh_objects[item];
+            const MeshBuffers &buffers = obj.mesh().buffers();
+            int instance = -1;
+            Vec3 normal;
+            if (obj.is_instanced()) {
+                const std::vector<Instance> &instances = ((const InstancedObject&)obj).instances;
+                for (int i=0; i<(int)instances.size(); i++) {
+                    if (intersect(buffers, instances[i], origin, direction, closest, normal))
+                        instance = i;
+                }
+                if (instance == -1) return closest;
+            } else {
+                Instance whole(obj.position, obj.euler_angles, obj.scale);
+                if (!intersect(buffers, whole, origin, direction, closest, normal)) return closest;
+            }
+
+            found = true;
+            hit.name = this->_bvh_names[item];
+            hit.object = this->_bvh_objects[item];
+            hit.instance = instance;
+            hit.distance = closest;
+            hit.position = origin + direction * closest;
+            hit.normal = normal;
+            return closest;
+        });
+        return found;
+    }
+}
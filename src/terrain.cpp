@@ -0,0 +1,448 @@
+#include "terrain.h"
+#include "mesh.h"
+#include "objects.h"
+#include "page_cache.h"
+#include "texture.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace proxima {
+    const uint64_t NO_NODE = ~(uint64_t)0;
+
+    uint64_t node_key(int level, int x, int y) {
+        return (uint64_t)level << 48 | (uint64_t)y << 24 | x;
+    }
+
+    // Row and column of the point t along an edge of a chunk, the edges going top, right,
+    // bottom and left, each in the direction of increasing row or column
+    std::array<int, 2> edge_point(int edge, int t, int resolution) {
+        switch (edge) {
+            case 0: return {0, t};
+            case 1: return {t, resolution};
+            case 2: return {resolution, t};
+            default: return {t, 0};
+        }
+    }
+
+    // The corners the edges run from and to, corners going clockwise from the top left
+    const int EDGE_CORNERS[4][2] = {{0, 1}, {1, 2}, {3, 2}, {0, 3}};
+
+    // Where the copies of the edges and corners for d levels up start in a chunk's vertices
+    int edge_vertex(int resolution, int d, int edge, int k) {
+        int first = (resolution + 1) * (resolution + 1);
+        for (int i=1; i<d; i++) {
+            first += 4 * ((resolution >> i) - 1);
+        }
+        return first + edge * ((resolution >> d) - 1) + k - 1;
+    }
+
+    int corner_vertex(int resolution, int max_diff, int d, int corner) {
+        return edge_vertex(resolution, max_diff + 1, 0, 1) + (d - 1) * 4 + corner;
+    }
+
+    // Triangles of a chunk meeting neighbours as many levels coarser as the key holds, three
+    // bits for each of the edges and then for each of the corners. A coarser edge only keeps
+    // the vertices its neighbour has and the ring of quads along it is zipped up to them.
+    std::vector<uint32_t> stitch_indices(int resolution, int max_diff, uint32_t key) {
+        int n = resolution + 1;
+        std::vector<uint32_t> indices;
+        // Wound the way the grid of Mesh::Plane is, which faces up
+        auto emit = [&](std::array<int, 3> a, std::array<int, 3> b, std::array<int, 3> c) {
+            if ((b[2] - a[2]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[2] - a[2]) > 0)
+                std::swap(b, c);
+            indices.insert(indices.end(), {(uint32_t)a[0], (uint32_t)b[0], (uint32_t)c[0]});
+        };
+
+        for (int r=1; r<resolution-1; r++) {
+            for (int c=1; c<resolution-1; c++) {
+                std::array<int, 3> a{r * n + c, r, c};
+                std::array<int, 3> b{(r + 1) * n + c, r + 1, c};
+                std::array<int, 3> d{(r + 1) * n + c + 1, r + 1, c + 1};
+                std::array<int, 3> e{r * n + c + 1, r, c + 1};
+                emit(a, b, d);
+                emit(d, e, a);
+            }
+        }
+
+        for (int edge=0; edge<4; edge++) {
+            int d = (key >> (3 * edge)) & 7;
+            // Vertex, row and column and the position along the edge, outside and one row in
+            std::vector<std::array<int, 4>> outer;
+            std::vector<std::array<int, 4>> inner;
+            for (int t=0; t<=resolution; t+=1<<d) {
+                auto [r, c] = edge_point(edge, t, resolution);
+                int vertex = r * n + c;
+                if (t == 0 || t == resolution) {
+                    int corner = EDGE_CORNERS[edge][t != 0];
+                    int corner_diff = (key >> (12 + 3 * corner)) & 7;
+                    if (corner_diff) vertex = corner_vertex(resolution, max_diff, corner_diff, corner);
+                } else if (d) {
+                    vertex = edge_vertex(resolution, d, edge, t >> d);
+                }
+                outer.push_back({vertex, r, c, t});
+            }
+            for (int t=1; t<resolution; t++) {
+                auto [r, c] = edge_point(edge, t, resolution);
+                r += (edge == 0) - (edge == 2);
+                c += (edge == 3) - (edge == 1);
+                inner.push_back({r * n + c, r, c, t});
+            }
+
+            int i = 0;
+            int j = 0;
+            while (i + 1 < (int)outer.size() || j + 1 < (int)inner.size()) {
+                auto vertex = [](const std::array<int, 4> &v) { return std::array<int, 3>{v[0], v[1], v[2]}; };
+                if (j + 1 == (int)inner.size() || (i + 1 < (int)outer.size() && outer[i+1][3] <= inner[j+1][3])) {
+                    emit(vertex(outer[i]), vertex(outer[i+1]), vertex(inner[j]));
+                    i++;
+                } else {
+                    emit(vertex(outer[i]), vertex(inner[j+1]), vertex(inner[j]));
+                    j++;
+                }
+            }
+        }
+        return indices;
+    }
+
+    TerrainObject::TerrainObject(std::string heightmap, float size, float height, int resolution, Texture texture) : Object(Mesh(), texture) {
+        this->_is_terrain = true;
+        this->_size = size;
+        this->_height = height;
+        this->max_chunks = 512;
+
+        // Heights get a page file of their own, as they keep only the gray level. Without one
+        // the terrain is left empty.
+        this->_heights = open_page_file(heightmap, heightmap + ".heights.pages", 1);
+        this->_map_width = this->_heights ? this->_heights->width() : 0;
+        this->_map_height = this->_heights ? this->_heights->height() : 0;
+
+        // The map's last row and column are its far edges, so a 2^n + 1 map fills the root exactly
+        this->_extent = 1;
+        while (this->_extent < std::max(this->_map_width, this->_map_height) - 1) {
+            this->_extent *= 2;
+        }
+        // Stitch keys keep 3 bits per side, so chunks can't be more than 128 quads across, and
+        // halving must keep landing on whole quads
+        int rounded = 2;
+        while (rounded * 2 <= std::min(resolution, 128)) {
+            rounded *= 2;
+        }
+        this->_resolution = std::min(rounded, this->_extent);
+        this->_max_level = 0;
+        while (this->_resolution << this->_max_level < this->_extent) {
+            this->_max_level++;
+        }
+        this->_max_diff = 0;
+        while (1 << this->_max_diff < this->_resolution) {
+            this->_max_diff++;
+        }
+
+        this->_building = NO_NODE;
+        this->_frame = 0;
+        this->_stopping = false;
+        this->_worker = std::thread(&TerrainObject::_work, this);
+    }
+
+    TerrainObject::~TerrainObject() {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_stopping = true;
+        }
+        this->_wake.notify_one();
+        this->_worker.join();
+    }
+
+    int TerrainObject::num_chunks() const {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        return this->_chunks.size();
+    }
+
+    int TerrainObject::num_requests() const {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        return this->_requests.size() + (this->_building != NO_NODE);
+    }
+
+    BoundingBox TerrainObject::bounding_box() const {
+        if (!this->_heights) return Object::bounding_box();
+        float depth = this->_size * (this->_map_height - 1) / std::max(1, this->_map_width - 1);
+        BoundingBox local;
+        local.min = Vec3(-this->_size / 2, 0, -depth / 2);
+        local.max = Vec3(this->_size / 2, this->_height, depth / 2);
+        return transform_box(local, this->position, this->euler_angles, this->scale);
+    }
+
+    // Height at texel gx, gy of the map filtered from a mip level, from 0 to 255, with texels
+    // past the map taken from its edge. Coarser texels are centered between the ones they cover,
+    // so they are blended back to the texel rather than read at it.
+    float TerrainObject::_sample(int mip, int gx, int gy) const {
+        const std::vector<PageLevel> &levels = this->_heights->levels();
+        mip = std::min(mip, (int)levels.size() - 1);
+        const PageLevel &level = levels[mip];
+        float fx = (std::clamp(gx, 0, this->_map_width - 1) + 0.5f) / (1 << mip) - 0.5f;
+        float fy = (std::clamp(gy, 0, this->_map_height - 1) + 0.5f) / (1 << mip) - 0.5f;
+        int x = floor(fx);
+        int y = floor(fy);
+        float tx = fx - x;
+        float ty = fy - y;
+        int x0 = std::clamp(x, 0, level.width - 1);
+        int x1 = std::clamp(x + 1, 0, level.width - 1);
+        int y0 = std::clamp(y, 0, level.height - 1);
+        int y1 = std::clamp(y + 1, 0, level.height - 1);
+        float top = (this->_heights->texel(mip, x0, y0) >> 24) * (1 - tx) + (this->_heights->texel(mip, x1, y0) >> 24) * tx;
+        float bottom = (this->_heights->texel(mip, x0, y1) >> 24) * (1 - tx) + (this->_heights->texel(mip, x1, y1) >> 24) * tx;
+        return top * (1 - ty) + bottom * ty;
+    }
+
+    // The vertex at texel gx, gy as a chunk sampling the mip level sees it. Depends on nothing
+    // else, so neighbouring chunks sampling the same level come up with the same vertex.
+    BufferVertex TerrainObject::_vertex(int mip, int gx, int gy) const {
+        float texel_size = this->_size / std::max(1, this->_map_width - 1);
+        float height_scale = this->_height / 255;
+        int k = 1 << mip;
+        float dx = (this->_sample(mip, gx + k, gy) - this->_sample(mip, gx - k, gy)) * height_scale / (2 * k * texel_size);
+        float dz = (this->_sample(mip, gx, gy + k) - this->_sample(mip, gx, gy - k)) * height_scale / (2 * k * texel_size);
+
+        int x = std::clamp(gx, 0, this->_map_width - 1);
+        int y = std::clamp(gy, 0, this->_map_height - 1);
+        Vec3 position(
+            x * texel_size - this->_size / 2,
+            this->_sample(mip, gx, gy) * height_scale,
+            (y - (this->_map_height - 1) * 0.5f) * texel_size
+        );
+        Vec3 uv((float)x / std::max(1, this->_map_width - 1), 1 - (float)y / std::max(1, this->_map_height - 1), 0);
+        return BufferVertex(position, Vec3(-dx, 1, -dz).normalized(), uv);
+    }
+
+    std::shared_ptr<const TerrainChunk> TerrainObject::_build(uint64_t node) const {
+        std::shared_ptr<TerrainChunk> chunk = std::make_shared<TerrainChunk>();
+        chunk->level = node >> 48;
+        chunk->y = (node >> 24) & 0xffffff;
+        chunk->x = node & 0xffffff;
+        int resolution = this->_resolution;
+        int n = resolution + 1;
+        int span = this->_extent >> chunk->level;
+        int step = span / resolution;
+        int mip = this->_max_level - chunk->level;
+        int gx0 = chunk->x * span;
+        int gy0 = chunk->y * span;
+
+        // Each pass notes the pages the chunk reads and the cache then brings them in, until
+        // a pass finds them all in. Heights from the coarser levels standing in for missing
+        // pages would otherwise stay in the chunk for good.
+        std::vector<BufferVertex> &vertices = chunk->buffers.vertices;
+        while (true) {
+            vertices.clear();
+            for (int r=0; r<n; r++) {
+                for (int c=0; c<n; c++) {
+                    vertices.push_back(this->_vertex(mip, gx0 + c * step, gy0 + r * step));
+                }
+            }
+            for (int d=1; d<=this->_max_diff; d++) {
+                for (int edge=0; edge<4; edge++) {
+                    for (int t=1<<d; t<resolution; t+=1<<d) {
+                        auto [r, c] = edge_point(edge, t, resolution);
+                        vertices.push_back(this->_vertex(mip + d, gx0 + c * step, gy0 + r * step));
+                    }
+                }
+            }
+            for (int d=1; d<=this->_max_diff; d++) {
+                for (int corner=0; corner<4; corner++) {
+                    int r = (corner >= 2) * resolution;
+                    int c = (corner == 1 || corner == 2) * resolution;
+                    vertices.push_back(this->_vertex(mip + d, gx0 + c * step, gy0 + r * step));
+                }
+            }
+
+            // Compare the grid's triangles with the next level down halfway between its vertices
+            chunk->error = 0;
+            if (mip > 0) {
+                for (int r=0; r<=2*resolution; r++) {
+                    int i = std::min(r / 2, resolution - 1);
+                    float v = r * 0.5f - i;
+                    for (int c=0; c<=2*resolution; c++) {
+                        int j = std::min(c / 2, resolution - 1);
+                        float u = c * 0.5f - j;
+                        float ha = vertices[i * n + j].position.y;
+                        float hb = vertices[(i + 1) * n + j].position.y;
+                        float hc = vertices[(i + 1) * n + j + 1].position.y;
+                        float hd = vertices[i * n + j + 1].position.y;
+                        float coarse = v >= u ? ha + v * (hb - ha) + u * (hc - hb) : ha + u * (hd - ha) + v * (hc - hd);
+                        float fine = this->_sample(mip - 1, gx0 + c * step / 2, gy0 + r * step / 2) * this->_height / 255;
+                        chunk->error = fmax(chunk->error, fabs(fine - coarse));
+                    }
+                }
+            }
+
+            if (this->_heights->num_missing() == 0) break;
+            // The cache can't hold all the chunk reads at once, so it is left to be built again
+            if (this->_heights->stream() == 0) return nullptr;
+        }
+
+        BoundingBox &box = chunk->buffers.bounding_box;
+        box.min = vertices[0].position;
+        box.max = box.min;
+        for (const BufferVertex &v : vertices) {
+            box.min = Vec3(fmin(box.min.x, v.position.x), fmin(box.min.y, v.position.y), fmin(box.min.z, v.position.z));
+            box.max = Vec3(fmax(box.max.x, v.position.x), fmax(box.max.y, v.position.y), fmax(box.max.z, v.position.z));
+        }
+        BoundingSphere &sphere = chunk->buffers.bounding_sphere;
+        sphere.center = (box.min + box.max) / 2;
+        sphere.radius = (box.max - sphere.center).magnitude();
+        return chunk;
+    }
+
+    void TerrainObject::_work() {
+        while (true) {
+            uint64_t node;
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_wake.wait(lock, [this] { return this->_stopping || !this->_requests.empty(); });
+                if (this->_stopping) return;
+                node = this->_requests.front();
+                this->_requests.erase(this->_requests.begin());
+                if (this->_chunks.count(node)) continue;
+                this->_building = node;
+            }
+            std::shared_ptr<const TerrainChunk> chunk = this->_build(node);
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            if (chunk) this->_chunks[node] = {chunk, this->_frame};
+            this->_building = NO_NODE;
+        }
+    }
+
+    void TerrainObject::select(Vec3 eye, float pixels_per_unit, std::function<bool(const MeshBuffers&)> visible, std::vector<TerrainPatch> &patches) const {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        this->_frame++;
+        patches.clear();
+        if (!this->_heights) return;
+
+        // Level, error in pixels and node of the chunks that are missing
+        std::vector<std::tuple<int, float, uint64_t>> wanted;
+        auto find = [&](uint64_t node) -> const TerrainChunk* {
+            auto entry = this->_chunks.find(node);
+            if (entry == this->_chunks.end()) return nullptr;
+            entry->second.second = this->_frame;
+            return entry->second.first.get();
+        };
+
+        // Walk down from the root, splitting chunks too coarse for where they are seen from
+        // once all their children are in
+        std::vector<const TerrainChunk*> leaves;
+        std::vector<uint64_t> stack;
+        if (find(node_key(0, 0, 0))) {
+            stack.push_back(node_key(0, 0, 0));
+        } else {
+            wanted.push_back({0, 0, node_key(0, 0, 0)});
+        }
+        while (!stack.empty()) {
+            const TerrainChunk &chunk = *find(stack.back());
+            stack.pop_back();
+            if (!visible(chunk.buffers)) continue;
+
+            const BoundingBox &box = chunk.buffers.bounding_box;
+            Vec3 offset(
+                fmax(fmax(box.min.x - eye.x, eye.x - box.max.x), 0.0f),
+                fmax(fmax(box.min.y - eye.y, eye.y - box.max.y), 0.0f),
+                fmax(fmax(box.min.z - eye.z, eye.z - box.max.z), 0.0f)
+            );
+            float pixels = chunk.error * pixels_per_unit / fmax(offset.magnitude(), 1e-3f);
+            bool split = chunk.level < this->_max_level && pixels > this->lod_pixel_error;
+            std::vector<uint64_t> children;
+            if (split) {
+                int span = this->_extent >> (chunk.level + 1);
+                for (int i=0; i<4; i++) {
+                    int x = 2 * chunk.x + (i & 1);
+                    int y = 2 * chunk.y + (i >> 1);
+                    // Children entirely past the map's last row or column have nothing to show
+                    if (x * span >= this->_map_width - 1 || y * span >= this->_map_height - 1) continue;
+                    uint64_t child = node_key(chunk.level + 1, x, y);
+                    children.push_back(child);
+                    if (!find(child)) {
+                        split = false;
+                        if (child != this->_building)
+                            wanted.push_back({chunk.level + 1, pixels, child});
+                    }
+                }
+            }
+            if (split) {
+                stack.insert(stack.end(), children.begin(), children.end());
+            } else {
+                leaves.push_back(&chunk);
+            }
+        }
+
+        // Each side of a seam takes the vertices of the coarser one. Neighbours further apart
+        // than a chunk can follow, which takes a steep change in error, are followed as far as
+        // it can, and can leave pinholes along the seam.
+        std::unordered_set<uint64_t> drawn;
+        for (const TerrainChunk *chunk : leaves) {
+            drawn.insert(node_key(chunk->level, chunk->x, chunk->y));
+        }
+        auto coarser = [&](int level, int x, int y) {
+            if (x < 0 || y < 0 || x >= 1 << level || y >= 1 << level) return 0;
+            for (int l=level-1; l>=0; l--) {
+                if (drawn.count(node_key(l, x >> (level - l), y >> (level - l))))
+                    return std::min(level - l, this->_max_diff);
+            }
+            return 0;
+        };
+        for (const TerrainChunk *chunk : leaves) {
+            int l = chunk->level;
+            int x = chunk->x;
+            int y = chunk->y;
+            uint32_t key =
+                  coarser(l, x, y - 1)
+                | coarser(l, x + 1, y) << 3
+                | coarser(l, x, y + 1) << 6
+                | coarser(l, x - 1, y) << 9
+                | std::max({coarser(l, x - 1, y - 1), coarser(l, x, y - 1), coarser(l, x - 1, y)}) << 12
+                | std::max({coarser(l, x + 1, y - 1), coarser(l, x, y - 1), coarser(l, x + 1, y)}) << 15
+                | std::max({coarser(l, x + 1, y + 1), coarser(l, x + 1, y), coarser(l, x, y + 1)}) << 18
+                | std::max({coarser(l, x - 1, y + 1), coarser(l, x - 1, y), coarser(l, x, y + 1)}) << 21;
+            auto stitch = this->_stitches.find(key);
+            if (stitch == this->_stitches.end())
+                stitch = this->_stitches.insert({key, stitch_indices(this->_resolution, this->_max_diff, key)}).first;
+            patches.push_back({this->_chunks[node_key(l, x, y)].first, &stitch->second});
+        }
+
+        // Drop the chunks unused the longest once over budget, never the ones in use
+        if ((int)this->_chunks.size() > this->max_chunks) {
+            std::vector<std::pair<int, uint64_t>> unused;
+            for (auto &entry : this->_chunks) {
+                if (entry.second.second != this->_frame)
+                    unused.push_back({entry.second.second, entry.first});
+            }
+            std::sort(unused.begin(), unused.end());
+            int excess = std::min<int>(this->_chunks.size() - this->max_chunks, unused.size());
+            for (int i=0; i<excess; i++) {
+                this->_chunks.erase(unused[i].second);
+            }
+        }
+
+        // Coarse chunks first, as each one unblocks the finer ones below it, then the worst
+        std::sort(wanted.begin(), wanted.end(), [](const auto &a, const auto &b) {
+            if (std::get<0>(a) != std::get<0>(b)) return std::get<0>(a) < std::get<0>(b);
+            return std::get<1>(a) > std::get<1>(b);
+        });
+        this->_requests.clear();
+        for (const auto &entry : wanted) {
+            this->_requests.push_back(std::get<2>(entry));
+        }
+        if (!this->_requests.empty())
+            this->_wake.notify_one();
+    }
+}
@@ -1,50 +1,335 @@
+#include "page_cache.h"
 #include "texture.h"
 #include "vec3.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
-#include <cmath>
 
 #include "stb_image.h"
 
 namespace proxima {
+    // Textures loaded or generated so far, kept for as long as some handle is alive
+    std::map<std::string, std::weak_ptr<const TextureData>> texture_cache;
+    std::mutex texture_cache_mutex;
+
+    std::shared_ptr<const TextureData> find_cached_texture(std::string key) {
+        std::lock_guard<std::mutex> lock(texture_cache_mutex);
+        auto entry = texture_cache.find(key);
+        return entry == texture_cache.end() ? nullptr : entry->second.lock();
+    }
+
+    // Built outside the lock, so if two threads race the first one to finish wins
+    std::shared_ptr<const TextureData> cache_texture(std::string key, TextureData &&texture) {
+        std::lock_guard<std::mutex> lock(texture_cache_mutex);
+        std::shared_ptr<const TextureData> data = texture_cache[key].lock();
+        if (!data) {
+            data = std::make_shared<const TextureData>(std::move(texture));
+            texture_cache[key] = data;
+        }
+        return data;
+    }
+
+    std::atomic<int> next_texture_id = 1;
+
+    uint32_t expand_565(uint16_t color) {
+        uint32_t r = (color >> 11) & 0x1f;
+        uint32_t g = (color >> 5) & 0x3f;
+        uint32_t b = color & 0x1f;
+        return ((r << 3 | r >> 2) << 24) | ((g << 2 | g >> 4) << 16) | ((b << 3 | b >> 2) << 8) | 0xff;
+    }
+
+    // The four colors a BC1 block picks from, packed as 0xRRGGBBAA
+    std::array<uint32_t, 4> bc1_palette(uint16_t c0, uint16_t c1) {
+        uint32_t a = expand_565(c0);
+        uint32_t b = expand_565(c1);
+        if (c0 <= c1) return {a, b, lerp_rgba(a, b, 128), lerp_rgba(a, b, 128)};
+        return {a, b, lerp_rgba(a, b, 85), lerp_rgba(a, b, 171)};
+    }
+
+    // Compresses a row major level to BC1 blocks, repeating the last row or column of sizes
+    // that are not a multiple of 4. The endpoints are the texels furthest apart along the
+    // direction the block varies the most in.
+    void encode_bc1(const uint8_t *in, int width, int height, int channels, uint8_t *out) {
+        for (int by=0; by<height; by+=4) {
+            for (int bx=0; bx<width; bx+=4) {
+                std::array<Vec3, 16> colors;
+                Vec3 mean;
+                for (int i=0; i<16; i++) {
+                    int x = std::min(bx + (i & 3), width - 1);
+                    int y = std::min(by + (i >> 2), height - 1);
+                    const uint8_t *texel = &in[(x + (size_t)y * width) * channels];
+                    colors[i] = channels == 1 ? Vec3(texel[0], texel[0], texel[0]) : Vec3(texel[0], texel[1], texel[2]);
+                    mean += colors[i] / 16;
+                }
+
+                // A few rounds of power iteration on the covariance find the main axis
+                float cov[6] = {};
+                for (const Vec3 &color : colors) {
+                    Vec3 d = color - mean;
+                    cov[0] += d.x * d.x; cov[1] += d.x * d.y; cov[2] += d.x * d.z;
+                    cov[3] += d.y * d.y; cov[4] += d.y * d.z; cov[5] += d.z * d.z;
+                }
+                Vec3 axis(1, 1, 1);
+                for (int k=0; k<4; k++) {
+                    axis = Vec3(
+                        cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+                        cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+                        cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z
+                    );
+                    float length = axis.magnitude();
+                    if (length < 1e-6f) break;
+                    axis = axis / length;
+                }
+                int lo = 0, hi = 0;
+                for (int i=1; i<16; i++) {
+                    if (dot(colors[i], axis) < dot(colors[lo], axis)) lo = i;
+                    if (dot(colors[i], axis) > dot(colors[hi], axis)) hi = i;
+                }
+
+                auto to_565 = [](Vec3 c) {
+                    return (uint16_t)(((int)(c.x * 31 / 255 + 0.5f) << 11) | ((int)(c.y * 63 / 255 + 0.5f) << 5) | (int)(c.z * 31 / 255 + 0.5f));
+                };
+                uint16_t c0 = to_565(colors[hi]);
+                uint16_t c1 = to_565(colors[lo]);
+                if (c0 < c1) std::swap(c0, c1);
+
+                // Equal endpoints leave the block a flat color, which index 0 covers
+                uint32_t indices = 0;
+                if (c0 != c1) {
+                    std::array<uint32_t, 4> palette = bc1_palette(c0, c1);
+                    for (int i=0; i<16; i++) {
+                        int best = 0;
+                        float best_error = std::numeric_limits<float>::max();
+                        for (int k=0; k<4; k++) {
+                            Vec3 p(palette[k] >> 24, (palette[k] >> 16) & 0xff, (palette[k] >> 8) & 0xff);
+                            Vec3 d = p - colors[i];
+                            float error = dot(d, d);
+                            if (error < best_error) {
+                                best_error = error;
+                                best = k;
+                            }
+                        }
+                        indices |= best << (2 * i);
+                    }
+                }
+                out[0] = c0 & 0xff;
+                out[1] = c0 >> 8;
+                out[2] = c1 & 0xff;
+                out[3] = c1 >> 8;
+                out[4] = indices & 0xff;
+                out[5] = (indices >> 8) & 0xff;
+                out[6] = (indices >> 16) & 0xff;
+                out[7] = indices >> 24;
+                out += 8;
+            }
+        }
+    }
+
+    // Blocks each thread decoded lately, so neighbouring samples skip decoding them again
+    class DecodedBlock {
+    public:
+        uint64_t key;
+        uint32_t texels[16];
+    };
+    thread_local std::array<DecodedBlock, 64> decoded_blocks;
+
+    uint32_t TextureData::compressed_texel(const TextureLevel &level, int x, int y) const {
+        size_t block = level.offset + ((size_t)(y >> 2) * level.tiles_x + (x >> 2)) * 8;
+        uint64_t key = ((uint64_t)this->id << 40) | block;
+        DecodedBlock &entry = decoded_blocks[(key * 0x9e3779b97f4a7c15ull) >> 58];
+        if (entry.key != key) {
+            const uint8_t *in = &this->texels[block];
+            std::array<uint32_t, 4> palette = bc1_palette(in[0] | (in[1] << 8), in[2] | (in[3] << 8));
+            uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+            for (int i=0; i<16; i++) {
+                entry.texels[i] = palette[(indices >> (2 * i)) & 3];
+            }
+            entry.key = key;
+        }
+        return entry.texels[((y & 3) << 2) | (x & 3)];
+    }
+
+    // Bits needed to count up to n - 1
+    int ceil_log2(int n) {
+        int bits = 0;
+        while ((1 << bits) < n) bits++;
+        return bits;
+    }
+
+    void TextureData::build_levels(TextureLayout layout) {
+        // Count the texels of the whole chain first, so the array is only grown once
+        this->id = next_texture_id++;
+        this->layout = LAYOUT_LINEAR;
+        this->levels = {{this->width, this->height, 0, 0, 0}};
+        size_t size = (size_t)this->width * this->height * this->channels;
+        while (this->levels.back().width > 1 || this->levels.back().height > 1) {
+            const TextureLevel &prev = this->levels.back();
+            TextureLevel level{std::max(1, prev.width / 2), std::max(1, prev.height / 2), size, 0, 0};
+            size += (size_t)level.width * level.height * this->channels;
+            this->levels.push_back(level);
+        }
+        this->texels.resize(size);
+
+        // Each texel averages the 2x2 texels below it, repeating the last row or column of odd sizes
+        int c = this->channels;
+        for (int l=1; l<(int)this->levels.size(); l++) {
+            const TextureLevel &src = this->levels[l-1];
+            const TextureLevel &dst = this->levels[l];
+            const uint8_t *in = &this->texels[src.offset];
+            uint8_t *out = &this->texels[dst.offset];
+            for (int y=0; y<dst.height; y++) {
+                int y0 = std::min(2 * y, src.height - 1) * src.width;
+                int y1 = std::min(2 * y + 1, src.height - 1) * src.width;
+                for (int x=0; x<dst.width; x++) {
+                    int x0 = std::min(2 * x, src.width - 1);
+                    int x1 = std::min(2 * x + 1, src.width - 1);
+                    for (int k=0; k<c; k++) {
+                        int sum = in[(y0 + x0) * c + k] + in[(y0 + x1) * c + k] + in[(y1 + x0) * c + k] + in[(y1 + x1) * c + k];
+                        out[(x + y * dst.width) * c + k] = (sum + 2) >> 2;
+                    }
+                }
+            }
+        }
+        if (layout == LAYOUT_LINEAR) return;
+
+        // Then move every level into the blocked or compressed layout, padded out to whole blocks
+        std::vector<TextureLevel> linear_levels = std::move(this->levels);
+        std::vector<uint8_t> linear_texels = std::move(this->texels);
+        this->layout = layout;
+        this->levels.clear();
+        size = 0;
+        for (const TextureLevel &linear : linear_levels) {
+            TextureLevel level{linear.width, linear.height, size, 0, 0};
+            if (layout == LAYOUT_MORTON) {
+                int bits_x = ceil_log2(level.width);
+                int bits_y = ceil_log2(level.height);
+                level.morton_bits = std::min(bits_x, bits_y);
+                size += ((size_t)1 << (bits_x + bits_y)) * c;
+            } else if (layout == LAYOUT_BC1) {
+                level.tiles_x = (level.width + 3) / 4;
+                size += (size_t)level.tiles_x * ((level.height + 3) / 4) * 8;
+            } else {
+                int tile = layout == LAYOUT_TILED_4 ? 4 : 8;
+                level.tiles_x = (level.width + tile - 1) / tile;
+                size += (size_t)level.tiles_x * tile * ((level.height + tile - 1) / tile) * tile * c;
+            }
+            this->levels.push_back(level);
+        }
+        this->texels.assign(size, 0);
+        for (int l=0; l<(int)this->levels.size(); l++) {
+            const TextureLevel &level = this->levels[l];
+            const uint8_t *in = &linear_texels[linear_levels[l].offset];
+            if (layout == LAYOUT_BC1) {
+                encode_bc1(in, level.width, level.height, c, &this->texels[level.offset]);
+                continue;
+            }
+            for (int y=0; y<level.height; y++) {
+                for (int x=0; x<level.width; x++) {
+                    std::copy_n(in + (x + (size_t)y * level.width) * c, c, &this->texels[this->texel_offset(level, x, y)]);
+                }
+            }
+        }
+    }
+
     Texture::Texture(int width, int height) {
-        this->_width = width;
-        this->_height = height;
-        this->_data = std::vector<Vec3>(width * height);
+        TextureData texture{width, height, 4, std::vector<uint8_t>(width * height * 4), {}, LAYOUT_LINEAR};
+        texture.build_levels();
+        this->_data = std::make_shared<const TextureData>(std::move(texture));
+        this->sample_mode = SAMPLE_NEAREST;
     }
 
-    Texture::Texture(std::string filename) {
+    Texture::Texture(std::string filename, int channels, TextureLayout layout) {
+        this->sample_mode = SAMPLE_NEAREST;
+        if (channels != 1) channels = 4;
+        std::string key = "file " + std::to_string(channels) + " " + std::to_string(layout) + " " + filename;
+        this->_data = find_cached_texture(key);
+        if (this->_data) return;
+
+        // stb_image hands back the texels in the layout we keep, so copy them in one go
         int width, height, depth;
-        unsigned char *image = stbi_load(filename.c_str(), &width, &height, &depth, 3);
-        this->_width = width;
-        this->_height = height;
-        for (int i=0; i<width*height*3; i+=3) {
-            int r = image[i];
-            int g = image[i+1];
-            int b = image[i+2];
-            this->_data.push_back(Vec3(r, g, b) / 255);
+        unsigned char *image = stbi_load(filename.c_str(), &width, &height, &depth, channels);
+        if (!image) {
+            // An image that can't be read shows as white rather than bringing everything down
+            TextureData texture{1, 1, channels, std::vector<uint8_t>(channels, 255), {}, LAYOUT_LINEAR};
+            texture.build_levels(layout);
+            this->_data = std::make_shared<const TextureData>(std::move(texture));
+            return;
         }
+        TextureData texture{width, height, channels, std::vector<uint8_t>(image, image + width * height * channels), {}, LAYOUT_LINEAR};
         stbi_image_free(image);
+        texture.build_levels(layout);
+        this->_data = cache_texture(key, std::move(texture));
     }
 
     Texture Texture::Color(Vec3 color) {
-        Texture texture(1, 1);
-        texture._data[0] = color;
-        return texture;
+        uint8_t r = fmax(0, fmin(1, color.x)) * 255 + 0.5f;
+        uint8_t g = fmax(0, fmin(1, color.y)) * 255 + 0.5f;
+        uint8_t b = fmax(0, fmin(1, color.z)) * 255 + 0.5f;
+        TextureData texture{1, 1, 4, {r, g, b, 0xff}, {}, LAYOUT_LINEAR};
+        texture.build_levels();
+        return Texture(std::make_shared<const TextureData>(std::move(texture)));
     }
 
     Texture Texture::Checker(int width, int height) {
-        Texture texture(width, height);
-        int index = 0;
-        for (int i=0; i<height; i++) {
-            for (int j=0; j<width; j++) {
-                int t = (i + j) & 1;
-                texture._data[index] = lerp(Vec3(0.1, 0.1, 0.1), Vec3(1, 1, 1), t);
-                index++;
+        // One texel per square, so the squares stay crisp up close
+        std::string key = "checker " + std::to_string(width) + " " + std::to_string(height);
+        std::shared_ptr<const TextureData> data = find_cached_texture(key);
+        if (!data) {
+            TextureData texture{width, height, 4, std::vector<uint8_t>(width * height * 4), {}, LAYOUT_LINEAR};
+            int index = 0;
+            for (int i=0; i<height; i++) {
+                for (int j=0; j<width; j++) {
+                    uint8_t level = (i + j) & 1 ? 255 : 26;
+                    texture.texels[index] = level;
+                    texture.texels[index+1] = level;
+                    texture.texels[index+2] = level;
+                    texture.texels[index+3] = 0xff;
+                    index += 4;
+                }
+            }
+            texture.build_levels();
+            data = cache_texture(key, std::move(texture));
+        }
+        return Texture(data);
+    }
+
+    Texture Texture::Virtual(std::string filename, int num_slots) {
+        std::string page_filename = filename + ".pages";
+        std::string key = "virtual " + page_filename;
+        std::shared_ptr<const TextureData> data = find_cached_texture(key);
+        if (!data) {
+            // Without a page file, as in a directory that can't be written, the whole image is kept
+            std::shared_ptr<PageCache> pages = open_page_file(filename, page_filename, 4, num_slots);
+            if (!pages) {
+                Texture texture(filename);
+                texture.sample_mode = SAMPLE_TRILINEAR;
+                return texture;
+            }
+            TextureData texture{pages->width(), pages->height(), pages->channels(), {}, {}, LAYOUT_VIRTUAL};
+            texture.id = next_texture_id++;
+            for (const PageLevel &level : pages->levels()) {
+                texture.levels.push_back({level.width, level.height, 0, level.pages_x, 0});
             }
+            texture.pages = pages;
+            data = cache_texture(key, std::move(texture));
         }
+        Texture texture(data);
+        texture.sample_mode = SAMPLE_TRILINEAR;
         return texture;
     }
-}
 
+    void Texture::stream() const {
+        if (this->_data->pages) this->_data->pages->stream();
+    }
+}
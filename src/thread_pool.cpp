@@ -0,0 +1,82 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace proxima {
+    ThreadPool::ThreadPool(int num_threads) {
+        this->_next_task = 0;
+        this->_num_tasks = 0;
+        this->_num_busy = 0;
+        this->_generation = 0;
+        this->_stopping = false;
+
+        // The calling thread takes part in every run, so spawn one less
+        for (int i=1; i<std::max(1, num_threads); i++) {
+            this->_workers.push_back(std::thread(&ThreadPool::_work, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_stopping = true;
+        }
+        this->_start.notify_all();
+        for (std::thread &worker : this->_workers) {
+            worker.join();
+        }
+    }
+
+    void ThreadPool::_drain() {
+        int task;
+        while ((task = this->_next_task.fetch_add(1)) < this->_num_tasks) {
+            this->_task(task);
+        }
+    }
+
+    void ThreadPool::_work() {
+        int generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_start.wait(lock, [&] {
+                    return this->_stopping || this->_generation != generation;
+                });
+                if (this->_stopping) return;
+                generation = this->_generation;
+            }
+            this->_drain();
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                this->_num_busy--;
+            }
+            this->_done.notify_one();
+        }
+    }
+
+    void ThreadPool::run(int num_tasks, std::function<void(int)> task) {
+        if (this->_workers.empty() || num_tasks <= 1) {
+            for (int i=0; i<num_tasks; i++) {
+                task(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_task = task;
+            this->_num_tasks = num_tasks;
+            this->_next_task = 0;
+            this->_num_busy = this->_workers.size();
+            this->_generation++;
+        }
+        this->_start.notify_all();
+        this->_drain();
+
+        std::unique_lock<std::mutex> lock(this->_mutex);
+        this->_done.wait(lock, [&] { return this->_num_busy == 0; });
+    }
+}
@@ -0,0 +1,66 @@
+#include "texture.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace proxima;
+
+// Compares every texel of the bundled images stored as BC1 blocks against the same images
+// stored row by row, and fails when the error grows past what BC1 should give. Sharp edges
+// between two colours in one block leave large errors on a few texels, so the largest error
+// is bounded loosely and the PSNR tightly.
+class Bounds {
+public:
+    std::string filename;
+    int channels;
+    double min_psnr;
+    int max_error;
+};
+
+int main() {
+    Bounds assets[] = {
+        {"./assets/cube_texture.png", 4, 37, 160},
+        {"./assets/heightmap.png", 1, 36, 32},
+        {"./assets/map.png", 4, 33, 128},
+        {"./assets/skybox.png", 4, 40, 64},
+        {"./assets/suzanne_texture.png", 4, 38, 32}
+    };
+
+    bool passed = true;
+    for (const Bounds &asset : assets) {
+        Texture linear(asset.filename, asset.channels, LAYOUT_LINEAR);
+        Texture bc1(asset.filename, asset.channels, LAYOUT_BC1);
+        if (linear.width() <= 1 && linear.height() <= 1) {
+            printf("%s: can't be read\n", asset.filename.c_str());
+            passed = false;
+            continue;
+        }
+
+        // Red, green and blue only, as BC1 keeps alpha to one bit
+        double squared_error = 0;
+        int max_error = 0;
+        for (int y=0; y<linear.height(); y++) {
+            for (int x=0; x<linear.width(); x++) {
+                Vec3 uv((x + 0.5f) / linear.width(), 1 - (y + 0.5f) / linear.height(), 0);
+                uint32_t expected = linear.rgba_at_uv(uv);
+                uint32_t actual = bc1.rgba_at_uv(uv);
+                for (int shift=8; shift<32; shift+=8) {
+                    int error = abs((int)((expected >> shift) & 0xff) - (int)((actual >> shift) & 0xff));
+                    squared_error += error * error;
+                    max_error = std::max(max_error, error);
+                }
+            }
+        }
+        double mse = squared_error / (3.0 * linear.width() * linear.height());
+        double psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+        bool ok = psnr >= asset.min_psnr && max_error <= asset.max_error;
+        printf("%s: %dx%d PSNR %.2f dB (at least %.0f), max error %d (at most %d) %s\n",
+            asset.filename.c_str(), linear.width(), linear.height(), psnr, asset.min_psnr, max_error, asset.max_error, ok ? "ok" : "FAILED");
+        passed = passed && ok;
+    }
+
+    return passed ? 0 : 1;
+}
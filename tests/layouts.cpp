@@ -0,0 +1,137 @@
+#include "mesh.h"
+#include "objects.h"
+#include "renderer.h"
+#include "scene.h"
+#include "texture.h"
+#include "vec3.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+using namespace proxima;
+
+// Hardware counter of this thread and the threads it starts after, or nothing where the
+// kernel won't hand one out
+class Counter {
+private:
+    int _fd;
+
+public:
+    Counter(uint32_t type, uint64_t config) {
+        this->_fd = -1;
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        this->_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~Counter() {
+#ifdef __linux__
+        if (this->_fd != -1) close(this->_fd);
+#endif
+    }
+    Counter(const Counter&) = delete;
+    Counter &operator=(const Counter&) = delete;
+    bool available() const { return this->_fd != -1; }
+    void start() {
+#ifdef __linux__
+        if (this->_fd == -1) return;
+        ioctl(this->_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(this->_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    // Counted since start(), summed over the threads that inherited it
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (this->_fd == -1) return 0;
+        ioctl(this->_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(this->_fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+        return count;
+    }
+};
+
+// Spins the textured cube and sphere of test.cpp with their textures stored in each layout
+// and prints the average frame time, and the cache misses per frame where the counters can
+// be read. Takes the number of frames to time and of render threads.
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 100;
+    int num_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    int width = 1280;
+    int height = 720;
+    const char *names[] = {"linear", "tiled 4", "tiled 8", "morton", "bc1", "virtual"};
+
+    printf("%-8s %10s %16s %16s\n", "layout", "ms/frame", "L1D misses", "LLC misses");
+    for (int layout=LAYOUT_LINEAR; layout<=LAYOUT_VIRTUAL; layout++) {
+        // Opened before the renderer starts its threads, so that they inherit them
+#ifdef __linux__
+        Counter l1d_misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        Counter llc_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+        Counter l1d_misses(0, 0);
+        Counter llc_misses(0, 0);
+#endif
+        Renderer renderer(width, height, num_threads);
+        Scene scene;
+        scene.camera.position = Vec3(0, 0, 4);
+        scene["sun"] = new PointLight(10000, Vec3(1, 1, 1));
+        scene["sun"]->position = Vec3(0, 100, 100);
+
+        TextureLayout l = (TextureLayout)layout;
+        Texture cube_texture = l == LAYOUT_VIRTUAL ? Texture::Virtual("./assets/cube_texture.png") : Texture("./assets/cube_texture.png", 4, l);
+        Texture sphere_texture = l == LAYOUT_VIRTUAL ? Texture::Virtual("./assets/map.png") : Texture("./assets/map.png", 4, l);
+        // Filtered the way virtual textures are, so every layout does the same work
+        cube_texture.sample_mode = SAMPLE_TRILINEAR;
+        sphere_texture.sample_mode = SAMPLE_TRILINEAR;
+        scene["cuboid"] = new Object(Mesh::Cube(), cube_texture);
+        scene["cuboid"]->position = Vec3(-1.5, 0, 0);
+        scene["sphere"] = new Object(Mesh::Sphere(), sphere_texture);
+        scene["sphere"]->position = Vec3(1.5, 0, 0);
+
+        auto spin = [&]() {
+            scene["cuboid"]->euler_angles += Vec3(4, 2, 4);
+            scene["sphere"]->euler_angles += Vec3(0, 5, 0);
+            renderer.render(scene);
+        };
+        // A few frames first, so virtual textures have their pages in
+        for (int i=0; i<10; i++) {
+            spin();
+        }
+
+        l1d_misses.start();
+        llc_misses.start();
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<frames; i++) {
+            spin();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        uint64_t l1d = l1d_misses.stop();
+        uint64_t llc = llc_misses.stop();
+
+        auto per_frame = [&](const Counter &counter, uint64_t count) {
+            return counter.available() ? std::to_string(count / frames) : std::string("n/a");
+        };
+        printf("%-8s %10.2f %16s %16s\n", names[layout], ms / frames, per_frame(l1d_misses, l1d).c_str(), per_frame(llc_misses, llc).c_str());
+    }
+
+    return 0;
+}
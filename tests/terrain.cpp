@@ -0,0 +1,26 @@
+#include "proxima.h"
+#include "control.h"
+#include "dashboard.h"
+
+using namespace proxima;
+
+int main() {
+    int width = 1280;
+    int height = 720;
+    Window window(width, height);
+    Renderer renderer(width, height);
+    Scene scene(Texture::Color(Vec3(0.5, 0.7, 1)));
+
+    scene["sun"] = new PointLight(2000000);
+    scene["sun"]->position = Vec3(300, 1000, 200);
+    scene["terrain"] = new TerrainObject("./assets/heightmap.png", 1000, 100, 32, Texture::Checker(64, 64));
+    scene.camera.position = Vec3(0, 120, 0);
+
+    while (!window.closed()) {
+        control(window, scene.camera);
+        window.draw(renderer.render(scene));
+        show_fps();
+    }
+
+    return 0;
+}
@@ -30,7 +30,7 @@ int main() {
     scene["donut"] = new Object(Mesh::Torus(), Texture::Checker(16, 8));
     scene["donut"]->position = Vec3(0, 5, 0);
 
-    scene["monkey"] = new Object(Mesh("./assets/suzanne.obj"), Texture("./assets/suzanne_texture.png"));
+    scene["monkey"] = new Object(Mesh("./assets/suzanne.obj").optimize(), Texture("./assets/suzanne_texture.png"));
     scene["monkey"]->position = Vec3(-5, 0, 0);
 
     scene["cuboid"] = new Object(Mesh::Cube(), Texture("./assets/cube_texture.png"));
@@ -39,12 +39,13 @@ int main() {
     scene["sphere"] = new Object(Mesh::Sphere(), Texture("./assets/map.png"));
     scene["sphere"]->position = Vec3(0, 0, 0);
 
-    scene["teapot"] = new Object(Mesh("./assets/teapot.obj"), Texture::Color(Vec3(0.8, 0.8, 0.8)));
+    scene["teapot"] = new Object(Mesh("./assets/teapot.obj").optimize(), Texture::Color(Vec3(0.8, 0.8, 0.8)));
     scene["teapot"]->position = Vec3(5, 0, 0);
     scene["teapot"]->euler_angles = Vec3(0, 90, 0);
+    scene["teapot"]->generate_lods();
 
     //scene["floor"] = new Object(Mesh::Plane(), Texture::Checker(8, 8));
-    //scene["floor"] = new Object(Mesh::Terrain(Texture("./assets/heightmap.png"), 100).smooth(), Texture::Checker(8, 8));
+    //scene["floor"] = new Object(Mesh::Terrain(Texture("./assets/heightmap.png", 1), 100).smooth(), Texture::Checker(8, 8));
     scene["floor"] = new Object(Mesh::Plot(f, 10, 100).smooth(), Texture::Checker(8, 8));
     scene["floor"]->position = Vec3(0, -20, 0);
     scene["floor"]->scale = Vec3(100, 100, 100);